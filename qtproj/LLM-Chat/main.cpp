@@ -26,7 +26,7 @@ int main(int argc, char *argv[])
 
         cmd.add<std::string>("template_filename_axmodel", 0, "axmodel path template", false, attr.template_filename_axmodel);
         cmd.add<std::string>("filename_post_axmodel", 0, "post axmodel path", false, attr.filename_post_axmodel);
-        cmd.add<int>("tokenizer_type", 0, "tokenizer type 0:LLaMa 1:Qwen", false, attr.tokenizer_type);
+        cmd.add<int>("tokenizer_type", 0, "tokenizer type 0:LLaMa 1:Qwen 5:BPE(tokenizer.json)", false, attr.tokenizer_type);
         cmd.add<std::string>("filename_tokenizer_model", 0, "tokenizer model path", false, attr.filename_tokenizer_model);
         cmd.add<std::string>("filename_tokens_embed", 0, "tokens embed path", false, attr.filename_tokens_embed);
 
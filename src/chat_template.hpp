@@ -0,0 +1,29 @@
+#pragma once
+#include "runner/LLM.hpp"
+
+// main 和 llm_server 共用：TKT_BPE 的对话模板按词表中的特殊 token 识别
+
+enum BPEChatFormat
+{
+    BPE_CHAT_UNKNOWN,
+    BPE_CHAT_CHATML, // <|im_start|>，Qwen2 等
+    BPE_CHAT_LLAMA3, // <|start_header_id|>
+};
+
+// 在 llm.Init 之后调用，不是 TKT_BPE 或词表中没有对应的特殊 token 时返回 BPE_CHAT_UNKNOWN
+inline BPEChatFormat detect_bpe_chat_format(LLM &llm, TokenizerType tokenizer_type)
+{
+    if (tokenizer_type != TKT_BPE)
+    {
+        return BPE_CHAT_UNKNOWN;
+    }
+    if (llm.GetTokenID("<|im_start|>") >= 0)
+    {
+        return BPE_CHAT_CHATML;
+    }
+    if (llm.GetTokenID("<|start_header_id|>") >= 0)
+    {
+        return BPE_CHAT_LLAMA3;
+    }
+    return BPE_CHAT_UNKNOWN;
+}
@@ -0,0 +1,110 @@
+#pragma once
+#include "runner/LLM.hpp"
+#include "cmdline.hpp"
+
+// main 和 llm_server 共用的模型参数
+
+inline void add_llm_options(cmdline::parser &cmd, const LLMAttrType &attr)
+{
+    cmd.add<std::string>("template_filename_axmodel", 0, "axmodel path template", false, attr.template_filename_axmodel);
+    cmd.add<std::string>("filename_post_axmodel", 0, "post axmodel path", false, attr.filename_post_axmodel);
+    cmd.add<int>("tokenizer_type", 0, "tokenizer type 0:LLaMa 1:Qwen 2:HTTP 3:Phi3 4:MINICPM 5:BPE(tokenizer.json)", false, attr.tokenizer_type);
+    cmd.add<std::string>("filename_tokenizer_model", 0, "tokenizer model path", false, attr.filename_tokenizer_model);
+    cmd.add<int>("tokenizer_cache_capacity", 0, "num of bpe pieces cached by tokenizer(Qwen only), 0: disable", false, attr.tokenizer_cache_capacity);
+    cmd.add<std::string>("filename_tokens_embed", 0, "tokens embed path", false, attr.filename_tokens_embed);
+
+    cmd.add<bool>("use_topk", 0, "", false, attr.b_use_topk);
+
+    cmd.add<bool>("bos", 0, "", false, attr.b_bos);
+    cmd.add<bool>("eos", 0, "", false, attr.b_eos);
+    cmd.add<int>("axmodel_num", 0, "num of axmodel(for template)", false, attr.axmodel_num);
+    cmd.add<int>("tokens_embed_num", 0, "tokens embed num", false, attr.tokens_embed_num);
+    cmd.add<int>("tokens_embed_size", 0, "tokens embed size", false, attr.tokens_embed_size);
+
+    cmd.add<int>("init_thread_num", 0, "num of threads to load models in parallel", false, attr.init_thread_num);
+    cmd.add<bool>("use_mmap_load_embed", 0, "it can save os memory", false, attr.b_use_mmap_load_embed);
+    cmd.add<bool>("dynamic_load_axmodel_layer", 0, "it can save cmm memory", false, attr.b_dynamic_load_axmodel_layer);
+    cmd.add<int>("layer_cmm_budget", 0, "cmm budget(MB) of all layers when dynamic load, layers within budget stay resident, 0: all dynamic load", false, attr.layer_cmm_budget);
+    cmd.add<int>("dynamic_load_cmm_budget", 0, "cmm budget(MB) of resident layers when dynamic load, 0: prefetch next layer, <0: no prefetch", false, attr.dynamic_load_cmm_budget);
+    cmd.add<bool>("async_inference", 0, "overlap host work with npu inference when decoding", false, attr.b_async_inference);
+
+    cmd.add<std::string>("post_config_path", 0, "post config path", false, attr.post_config_path);
+    cmd.add<int>("max_new_tokens", 0, "max tokens generated per run, <=0: limited by max_token_len only", false, attr.max_new_tokens);
+
+    cmd.add<std::string>("draft_template_filename_axmodel", 0, "draft model axmodel path template for speculative decoding, empty to disable", false, "");
+    cmd.add<int>("draft_axmodel_num", 0, "num of draft axmodel, required with draft model", false, 0);
+    cmd.add<std::string>("draft_filename_post_axmodel", 0, "draft post axmodel path", false, "");
+    cmd.add<std::string>("draft_filename_tokens_embed", 0, "draft tokens embed path", false, "");
+    cmd.add<int>("draft_tokens_embed_size", 0, "draft tokens embed size, required with draft model", false, 0);
+    cmd.add<std::string>("draft_post_config_path", 0, "draft post config path, empty for greedy", false, "");
+    cmd.add<int>("speculative_k", 0, "max draft tokens per step", false, attr.speculative_k);
+    cmd.add<bool>("prompt_lookup", 0, "speculative decoding with drafts looked up from prompt and history", false, attr.b_prompt_lookup);
+    cmd.add<int>("prompt_lookup_ngram", 0, "max ngram size of prompt lookup", false, attr.prompt_lookup_ngram);
+    cmd.add<int>("prompt_lookup_min_ngram", 0, "min ngram size of prompt lookup", false, attr.prompt_lookup_min_ngram);
+}
+
+inline void get_llm_options(cmdline::parser &cmd, LLMAttrType &attr)
+{
+    attr.tokenizer_type = (TokenizerType)cmd.get<int>("tokenizer_type");
+    attr.filename_tokenizer_model = cmd.get<std::string>("filename_tokenizer_model");
+    attr.tokenizer_cache_capacity = cmd.get<int>("tokenizer_cache_capacity");
+    attr.filename_tokens_embed = cmd.get<std::string>("filename_tokens_embed");
+    attr.filename_post_axmodel = cmd.get<std::string>("filename_post_axmodel");
+    attr.template_filename_axmodel = cmd.get<std::string>("template_filename_axmodel");
+    attr.b_use_topk = cmd.get<bool>("use_topk");
+    attr.b_bos = cmd.get<bool>("bos");
+    attr.b_eos = cmd.get<bool>("eos");
+    attr.axmodel_num = cmd.get<int>("axmodel_num");
+    attr.tokens_embed_num = cmd.get<int>("tokens_embed_num");
+    attr.tokens_embed_size = cmd.get<int>("tokens_embed_size");
+
+    attr.init_thread_num = cmd.get<int>("init_thread_num");
+    attr.b_use_mmap_load_embed = cmd.get<bool>("use_mmap_load_embed");
+    attr.b_dynamic_load_axmodel_layer = cmd.get<bool>("dynamic_load_axmodel_layer");
+    attr.dynamic_load_cmm_budget = cmd.get<int>("dynamic_load_cmm_budget");
+    attr.layer_cmm_budget = cmd.get<int>("layer_cmm_budget");
+    attr.b_async_inference = cmd.get<bool>("async_inference");
+
+    attr.post_config_path = cmd.get<std::string>("post_config_path");
+    attr.max_new_tokens = cmd.get<int>("max_new_tokens");
+
+    attr.speculative_k = cmd.get<int>("speculative_k");
+    attr.b_prompt_lookup = cmd.get<bool>("prompt_lookup");
+    attr.prompt_lookup_ngram = cmd.get<int>("prompt_lookup_ngram");
+    attr.prompt_lookup_min_ngram = cmd.get<int>("prompt_lookup_min_ngram");
+}
+
+// 按参数加载草稿模型，没有指定草稿模型时 draft 为空，加载失败返回 false
+inline bool init_draft_model(cmdline::parser &cmd, const LLMAttrType &attr, std::shared_ptr<LLM> &draft)
+{
+    draft = nullptr;
+    if (cmd.get<std::string>("draft_template_filename_axmodel") == "")
+    {
+        return true;
+    }
+
+    // 层数和 embedding 维度因模型而异，没有合适的默认值，必须指定
+    if (cmd.get<int>("draft_axmodel_num") <= 0 || cmd.get<int>("draft_tokens_embed_size") <= 0)
+    {
+        ALOGE("draft_axmodel_num and draft_tokens_embed_size are required for the draft model");
+        return false;
+    }
+
+    // 草稿模型与主模型共用 tokenizer，默认贪心采样
+    LLMAttrType draft_attr = attr;
+    draft_attr.template_filename_axmodel = cmd.get<std::string>("draft_template_filename_axmodel");
+    draft_attr.axmodel_num = cmd.get<int>("draft_axmodel_num");
+    draft_attr.filename_post_axmodel = cmd.get<std::string>("draft_filename_post_axmodel");
+    draft_attr.filename_tokens_embed = cmd.get<std::string>("draft_filename_tokens_embed");
+    draft_attr.tokens_embed_size = cmd.get<int>("draft_tokens_embed_size");
+    draft_attr.post_config_path = cmd.get<std::string>("draft_post_config_path");
+    draft_attr.b_use_topk = false;
+    draft_attr.runing_callback = nullptr;
+    draft = std::make_shared<LLM>();
+    if (!draft->Init(draft_attr))
+    {
+        draft = nullptr;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,586 @@
+#include "signal.h"
+#include <ctime>
+#include <deque>
+#include <mutex>
+
+#include "runner/LLM.hpp"
+#include "runner/LLMScheduler.hpp"
+
+#include "cmdline.hpp"
+#include "llm_options.hpp"
+#include "chat_template.hpp"
+#include "httplib.h"
+#include "json.hpp"
+
+static LLM lLaMa;
+static std::shared_ptr<LLM> draft;
+static httplib::Server server;
+
+// 所有请求经过调度器排队，推理在调度器的线程中进行
+static std::unique_ptr<LLMScheduler> scheduler;
+// 每个请求以它为基础覆盖采样参数，请求之间互不影响
+static nlohmann::json default_post_config;
+static std::string model_name;
+static TokenizerType tokenizer_type;
+
+static BPEChatFormat bpe_chat_format = BPE_CHAT_UNKNOWN;
+
+void __sigExit(int iSigNo)
+{
+    lLaMa.Stop();
+    server.stop();
+    return;
+}
+
+// 与 LLMPostprocess 的默认值一致，post_config.json 中的字段会覆盖这些值
+static nlohmann::json load_default_post_config(const std::string &path)
+{
+    nlohmann::json config = {
+        {"enable_temperature", false},
+        {"temperature", 1.0},
+        {"enable_repetition_penalty", false},
+        {"repetition_penalty", 1.0},
+        {"penalty_window", 20},
+        {"enable_top_p_sampling", false},
+        {"top_p", 1.0},
+        {"enable_top_k_sampling", false},
+        {"top_k", 1},
+        {"frequency_penalty", 0.0},
+        {"presence_penalty", 0.0},
+        {"seed", -1},
+    };
+    if (path.empty())
+    {
+        return config;
+    }
+    std::ifstream config_file(path);
+    if (config_file.is_open())
+    {
+        try
+        {
+            config.update(nlohmann::json::parse(config_file));
+        }
+        catch (const std::exception &e)
+        {
+            ALOGE("parse post config(%s) failed: %s", path.c_str(), e.what());
+        }
+    }
+    return config;
+}
+
+// 按 OpenAI 的请求字段覆盖采样参数；temperature 为 0 时贪心解码，
+// temperature > 0 而默认配置和请求都没有启用 top-p/top-k 时在整个分布上采样
+static nlohmann::json request_post_config(const nlohmann::json &body)
+{
+    nlohmann::json config = default_post_config;
+    bool b_greedy = false, b_sample = false;
+    if (body.contains("temperature") && body["temperature"].is_number())
+    {
+        float temperature = body["temperature"];
+        if (temperature <= 0.f)
+        {
+            b_greedy = true;
+        }
+        else
+        {
+            config["enable_temperature"] = true;
+            config["temperature"] = temperature;
+            b_sample = true;
+        }
+    }
+    bool b_top_p = body.contains("top_p") && body["top_p"].is_number();
+    if (b_top_p)
+    {
+        // top_p >= 1 表示不截断，保留默认配置的 top-k/top-p 设置
+        float top_p = std::min((float)body["top_p"], 1.f);
+        if (top_p < 1.f)
+        {
+            config["enable_top_p_sampling"] = true;
+            config["enable_top_k_sampling"] = false;
+        }
+        config["top_p"] = top_p;
+    }
+    // top_k 和 repetition_penalty 不是 OpenAI 的标准字段，常见的服务都支持
+    if (body.contains("top_k") && body["top_k"].is_number_integer())
+    {
+        int top_k = body["top_k"];
+        config["enable_top_k_sampling"] = top_k > 0;
+        config["enable_top_p_sampling"] = false;
+        config["top_k"] = top_k;
+    }
+    if (body.contains("repetition_penalty") && body["repetition_penalty"].is_number())
+    {
+        config["enable_repetition_penalty"] = true;
+        config["repetition_penalty"] = body["repetition_penalty"];
+    }
+    for (auto key : {"frequency_penalty", "presence_penalty"})
+    {
+        if (body.contains(key) && body[key].is_number())
+        {
+            config[key] = body[key];
+        }
+    }
+    if (body.contains("seed") && body["seed"].is_number_integer())
+    {
+        config["seed"] = body["seed"];
+    }
+
+    if (b_greedy)
+    {
+        config["enable_temperature"] = false;
+        config["enable_top_p_sampling"] = false;
+        config["enable_top_k_sampling"] = false;
+    }
+    else if (b_sample && !config["enable_top_p_sampling"].get<bool>() && !config["enable_top_k_sampling"].get<bool>())
+    {
+        config["enable_top_p_sampling"] = true;
+        if (!b_top_p)
+        {
+            config["top_p"] = 1.0;
+        }
+    }
+    return config;
+}
+
+// 请求的调度参数：priority 可以是 "interactive"/"normal"/"batch" 或对应的 0/1/2，默认流式请求为 interactive；
+// timeout 为秒，超时的请求返回已经生成的部分
+static LLMRequest make_request(const nlohmann::json &body, const std::string &prompt)
+{
+    LLMRequest request;
+    request.prompt = prompt;
+    request.priority = body.value("stream", false) ? LLM_PRIORITY_INTERACTIVE : LLM_PRIORITY_NORMAL;
+    if (body.contains("priority"))
+    {
+        auto &priority = body["priority"];
+        if (priority.is_number_integer())
+        {
+            request.priority = priority;
+        }
+        else if (priority.is_string())
+        {
+            std::string name = priority;
+            request.priority = name == "interactive" ? LLM_PRIORITY_INTERACTIVE : (name == "batch" ? LLM_PRIORITY_BATCH : LLM_PRIORITY_NORMAL);
+        }
+    }
+    if (body.contains("timeout") && body["timeout"].is_number())
+    {
+        float timeout = body["timeout"];
+        request.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds((long long)(timeout * 1000));
+    }
+    for (auto key : {"max_tokens", "max_completion_tokens"})
+    {
+        if (body.contains(key) && body[key].is_number_integer())
+        {
+            request.max_new_tokens = body[key];
+        }
+    }
+
+    nlohmann::json config = request_post_config(body);
+    request.setup = [config](LLM &llm)
+    {
+        llm.getPostprocess().apply_config(config);
+    };
+    return request;
+}
+
+
+// 按 tokenizer 类型把多轮对话拼成 prompt，格式与 main 中的 prompt_complete 一致
+static std::string chat_prompt(const nlohmann::json &messages)
+{
+    std::ostringstream oss_prompt;
+    bool b_has_system = false;
+    for (auto &message : messages)
+    {
+        b_has_system |= message.value("role", "") == "system";
+    }
+
+    switch (tokenizer_type)
+    {
+    case TKT_LLaMa:
+        for (auto &message : messages)
+        {
+            oss_prompt << "<|" << message.value("role", "user") << "|>\n"
+                       << message.value("content", "") << "</s>";
+        }
+        oss_prompt << "<|assistant|>\n";
+        break;
+    case TKT_MINICPM:
+        for (auto &message : messages)
+        {
+            std::string role = message.value("role", "user");
+            oss_prompt << (role == "assistant" ? "<AI>" : "<用户>") << message.value("content", "");
+        }
+        oss_prompt << "<AI>";
+        break;
+    case TKT_BPE:
+        if (bpe_chat_format == BPE_CHAT_LLAMA3)
+        {
+            for (auto &message : messages)
+            {
+                oss_prompt << "<|start_header_id|>" << message.value("role", "user") << "<|end_header_id|>\n\n"
+                           << message.value("content", "") << "<|eot_id|>";
+            }
+            oss_prompt << "<|start_header_id|>assistant<|end_header_id|>\n\n";
+            break;
+        }
+        // ChatML 与 Qwen 相同
+        [[fallthrough]];
+    case TKT_Qwen:
+        if (!b_has_system)
+        {
+            oss_prompt << "<|im_start|>system\nYou are a helpful assistant.<|im_end|>\n";
+        }
+        for (auto &message : messages)
+        {
+            oss_prompt << "<|im_start|>" << message.value("role", "user") << "\n"
+                       << message.value("content", "") << "<|im_end|>\n";
+        }
+        oss_prompt << "<|im_start|>assistant\n";
+        break;
+    case TKT_Phi3:
+    case TKT_HTTP:
+    default:
+        for (size_t i = 0; i < messages.size(); i++)
+        {
+            oss_prompt << (i ? "\n" : "") << messages[i].value("content", "");
+        }
+        if (tokenizer_type == TKT_Phi3)
+        {
+            oss_prompt << " ";
+        }
+        break;
+    }
+    return oss_prompt.str();
+}
+
+// 返回 s 中完整 UTF-8 字符的长度，回调按 token 分批 detokenize，末尾可能是被截断的多字节字符
+static size_t utf8_complete_size(const std::string &s)
+{
+    size_t i = s.size();
+    int n_cont = 0;
+    while (i > 0 && n_cont < 3 && ((unsigned char)s[i - 1] & 0xC0) == 0x80)
+    {
+        i--;
+        n_cont++;
+    }
+    if (i == 0)
+    {
+        return s.size();
+    }
+    unsigned char lead = s[i - 1];
+    int len = 1;
+    if ((lead & 0xE0) == 0xC0)
+        len = 2;
+    else if ((lead & 0xF0) == 0xE0)
+        len = 3;
+    else if ((lead & 0xF8) == 0xF0)
+        len = 4;
+    return n_cont + 1 < len ? i - 1 : s.size();
+}
+
+struct GenerateContext
+{
+    bool b_chat = false;
+    std::string id;
+    time_t created = 0;
+
+    // 推理线程产生的 SSE 数据，由 httplib 的线程写给客户端
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::string> events;
+    std::string pending; // 还不是完整 UTF-8 字符的部分
+};
+
+static std::string dump_json(const nlohmann::json &j)
+{
+    return j.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+}
+
+static nlohmann::json make_chunk(const GenerateContext &ctx, const std::string &text, const char *finish_reason)
+{
+    nlohmann::json choice = {{"index", 0}, {"finish_reason", nullptr}};
+    if (finish_reason)
+    {
+        choice["finish_reason"] = finish_reason;
+    }
+    if (ctx.b_chat)
+    {
+        choice["delta"] = text.empty() ? nlohmann::json::object() : nlohmann::json{{"content", text}};
+    }
+    else
+    {
+        choice["text"] = text;
+    }
+    return {
+        {"id", ctx.id},
+        {"object", ctx.b_chat ? "chat.completion.chunk" : "text_completion"},
+        {"created", ctx.created},
+        {"model", model_name},
+        {"choices", nlohmann::json::array({choice})},
+    };
+}
+
+static void push_text(GenerateContext &ctx, const char *p_str)
+{
+    {
+        std::lock_guard<std::mutex> lock(ctx.mtx);
+        ctx.pending += p_str;
+        size_t n = utf8_complete_size(ctx.pending);
+        if (n == 0)
+        {
+            return;
+        }
+        ctx.events.push_back(dump_json(make_chunk(ctx, ctx.pending.substr(0, n), nullptr)));
+        ctx.pending.erase(0, n);
+    }
+    ctx.cv.notify_one();
+}
+
+static bool write_event(httplib::DataSink &sink, const std::string &data)
+{
+    std::string event = "data: " + data + "\n\n";
+    return sink.write(event.data(), event.size());
+}
+
+static const char *finish_reason(const LLMResult &result)
+{
+    return result.stats.b_hit_eos ? "stop" : "length";
+}
+
+static nlohmann::json make_usage(const LLMRunStats &stats)
+{
+    return {
+        {"prompt_tokens", stats.prompt_tokens},
+        {"completion_tokens", stats.completion_tokens},
+        {"total_tokens", stats.prompt_tokens + stats.completion_tokens},
+    };
+}
+
+static void set_error(httplib::Response &res, int status, const std::string &message)
+{
+    res.status = status;
+    nlohmann::json error = {{"error", {{"message", message}, {"type", "invalid_request_error"}}}};
+    res.set_content(dump_json(error), "application/json");
+}
+
+static void handle_generate(const httplib::Request &req, httplib::Response &res, bool b_chat)
+{
+    nlohmann::json body;
+    try
+    {
+        body = nlohmann::json::parse(req.body);
+    }
+    catch (const std::exception &e)
+    {
+        set_error(res, 400, std::string("invalid json: ") + e.what());
+        return;
+    }
+
+    std::string prompt;
+    if (b_chat)
+    {
+        if (!body.contains("messages") || !body["messages"].is_array() || body["messages"].empty())
+        {
+            set_error(res, 400, "messages is required");
+            return;
+        }
+        if (tokenizer_type == TKT_BPE && bpe_chat_format == BPE_CHAT_UNKNOWN)
+        {
+            set_error(res, 400, "unknown chat template of the tokenizer, use /v1/completions with a formatted prompt");
+            return;
+        }
+        prompt = chat_prompt(body["messages"]);
+    }
+    else
+    {
+        if (!body.contains("prompt") || !body["prompt"].is_string())
+        {
+            set_error(res, 400, "prompt must be a string");
+            return;
+        }
+        prompt = body["prompt"];
+    }
+
+    auto ctx = std::make_shared<GenerateContext>();
+    ctx->b_chat = b_chat;
+    ctx->created = time(nullptr);
+    ctx->id = (b_chat ? "chatcmpl-" : "cmpl-") + std::to_string(ctx->created) + "-" + std::to_string((unsigned long long)ctx.get() & 0xffff);
+
+    LLMRequest request = make_request(body, prompt);
+    if (body.value("stream", false))
+    {
+        request.callback = [ctx](int *p_token, int n_token, const char *p_str, float token_per_sec)
+        {
+            push_text(*ctx, p_str);
+        };
+    }
+    auto ticket = scheduler->Submit(request);
+    if (!ticket)
+    {
+        set_error(res, 429, "too many requests in queue");
+        return;
+    }
+
+    if (!body.value("stream", false))
+    {
+        auto &result = ticket->Wait();
+        if (result.status == LLM_REQUEST_FAILED)
+        {
+            set_error(res, 400, "prompt is empty or too long");
+            return;
+        }
+        if (result.status == LLM_REQUEST_TIMEOUT && result.stats.output_ids.empty())
+        {
+            set_error(res, 504, "request timeout");
+            return;
+        }
+
+        nlohmann::json choice = {{"index", 0}, {"finish_reason", finish_reason(result)}};
+        if (b_chat)
+        {
+            choice["message"] = {{"role", "assistant"}, {"content", result.text}};
+        }
+        else
+        {
+            choice["text"] = result.text;
+        }
+        nlohmann::json response = {
+            {"id", ctx->id},
+            {"object", b_chat ? "chat.completion" : "text_completion"},
+            {"created", ctx->created},
+            {"model", model_name},
+            {"choices", nlohmann::json::array({choice})},
+            {"usage", make_usage(result.stats)},
+        };
+        res.set_content(dump_json(response), "application/json");
+        return;
+    }
+
+    res.set_header("Cache-Control", "no-cache");
+    res.set_chunked_content_provider("text/event-stream", [ctx, ticket](size_t offset, httplib::DataSink &sink)
+                                     {
+        if (ctx->b_chat)
+        {
+            auto chunk = make_chunk(*ctx, "", nullptr);
+            chunk["choices"][0]["delta"] = {{"role", "assistant"}, {"content", ""}};
+            write_event(sink, dump_json(chunk));
+        }
+
+        while (true)
+        {
+            // 先确认是否结束再取数据，结束前产生的数据都已经在队列中
+            bool b_done = ticket->IsDone();
+            std::deque<std::string> events;
+            {
+                std::unique_lock<std::mutex> lock(ctx->mtx);
+                if (!b_done)
+                {
+                    ctx->cv.wait_for(lock, std::chrono::milliseconds(50), [&ctx]
+                                     { return !ctx->events.empty(); });
+                }
+                events.swap(ctx->events);
+            }
+            for (auto &event : events)
+            {
+                if (!write_event(sink, event))
+                {
+                    // 客户端断开后取消请求，把模型让给后面的请求
+                    scheduler->Cancel(ticket);
+                    return false;
+                }
+            }
+            if (b_done)
+            {
+                break;
+            }
+            if (!sink.is_writable())
+            {
+                scheduler->Cancel(ticket);
+                return false;
+            }
+        }
+
+        auto &result = ticket->Wait();
+        std::string tail;
+        {
+            std::lock_guard<std::mutex> lock(ctx->mtx);
+            tail.swap(ctx->pending);
+        }
+        auto chunk = make_chunk(*ctx, tail, finish_reason(result));
+        chunk["usage"] = make_usage(result.stats);
+        write_event(sink, dump_json(chunk));
+        write_event(sink, "[DONE]");
+        sink.done();
+        return true; });
+}
+
+int main(int argc, char *argv[])
+{
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, __sigExit);
+    LLMAttrType attr;
+
+    cmdline::parser cmd;
+    add_llm_options(cmd, attr);
+    cmd.add<std::string>("host", 0, "listen address", false, "0.0.0.0");
+    cmd.add<int>("port", 0, "listen port", false, 8000);
+    cmd.add<std::string>("model_name", 0, "model name in responses", false, "ax-llm");
+    cmd.add<int>("queue_size", 0, "max num of waiting requests, more requests are rejected with 429", false, 16);
+
+    cmd.parse_check(argc, argv);
+
+    get_llm_options(cmd, attr);
+    model_name = cmd.get<std::string>("model_name");
+    tokenizer_type = attr.tokenizer_type;
+
+    if (!lLaMa.Init(attr))
+    {
+        return -1;
+    }
+    bpe_chat_format = detect_bpe_chat_format(lLaMa, tokenizer_type);
+    if (tokenizer_type == TKT_BPE && bpe_chat_format == BPE_CHAT_UNKNOWN)
+    {
+        ALOGW("no <|im_start|> or <|start_header_id|> in tokenizer, /v1/chat/completions is disabled");
+    }
+    if (!init_draft_model(cmd, attr, draft))
+    {
+        return -1;
+    }
+    if (draft)
+    {
+        lLaMa.SetDraftModel(draft);
+    }
+    default_post_config = load_default_post_config(attr.post_config_path);
+    scheduler.reset(new LLMScheduler(lLaMa, cmd.get<int>("queue_size")));
+    scheduler->Start();
+
+    server.Post("/v1/chat/completions", [](const httplib::Request &req, httplib::Response &res)
+                { handle_generate(req, res, true); });
+    server.Post("/v1/completions", [](const httplib::Request &req, httplib::Response &res)
+                { handle_generate(req, res, false); });
+    server.Get("/v1/models", [](const httplib::Request &req, httplib::Response &res)
+               {
+        nlohmann::json models = {
+            {"object", "list"},
+            {"data", nlohmann::json::array({{{"id", model_name}, {"object", "model"}, {"owned_by", "axera"}}})},
+        };
+        res.set_content(dump_json(models), "application/json"); });
+
+    std::string host = cmd.get<std::string>("host");
+    int port = cmd.get<int>("port");
+    ALOGI("llm server listen on %s:%d", host.c_str(), port);
+    if (!server.listen(host, port))
+    {
+        ALOGE("listen on %s:%d failed", host.c_str(), port);
+    }
+    scheduler->Stop();
+
+    lLaMa.SetDraftModel(nullptr);
+    if (draft)
+    {
+        draft->Deinit();
+    }
+    lLaMa.Deinit();
+
+    return 0;
+}
@@ -3,8 +3,12 @@
 #include "runner/LLM.hpp"
 
 #include "cmdline.hpp"
+#include "llm_options.hpp"
+#include "chat_template.hpp"
 
 static LLM lLaMa;
+static std::shared_ptr<LLM> draft;
+static BPEChatFormat bpe_chat_format = BPE_CHAT_UNKNOWN;
 
 void __sigExit(int iSigNo)
 {
@@ -33,6 +37,20 @@ std::string prompt_complete(std::string prompt, TokenizerType tokenizer_type)
     case TKT_Phi3:
         oss_prompt << prompt << " ";
         break;
+    case TKT_BPE:
+        if (bpe_chat_format == BPE_CHAT_LLAMA3)
+        {
+            oss_prompt << "<|start_header_id|>user<|end_header_id|>\n\n"
+                       << prompt << "<|eot_id|><|start_header_id|>assistant<|end_header_id|>\n\n";
+            break;
+        }
+        if (bpe_chat_format == BPE_CHAT_UNKNOWN)
+        {
+            oss_prompt << prompt;
+            break;
+        }
+        // ChatML 与 Qwen 相同
+        [[fallthrough]];
     case TKT_Qwen:
         oss_prompt << "<|im_start|>system\nYou are a helpful assistant.<|im_end|>";
         oss_prompt << "\n<|im_start|>user\n"
@@ -46,6 +64,49 @@ std::string prompt_complete(std::string prompt, TokenizerType tokenizer_type)
 
     return oss_prompt.str();
 }
+
+// 连续对话时历史已经保存在 kv cache 中，只需要补上上一轮的结束符和本轮的内容
+std::string prompt_continue(std::string prompt, TokenizerType tokenizer_type)
+{
+    std::ostringstream oss_prompt;
+    switch (tokenizer_type)
+    {
+    case TKT_LLaMa:
+        oss_prompt << "</s><|user|>\n"
+                   << prompt << "</s><|assistant|>\n";
+        break;
+    case TKT_MINICPM:
+        oss_prompt << "<用户>" << prompt << "<AI>";
+        break;
+    case TKT_Phi3:
+        oss_prompt << prompt << " ";
+        break;
+    case TKT_BPE:
+        if (bpe_chat_format == BPE_CHAT_LLAMA3)
+        {
+            oss_prompt << "<|eot_id|><|start_header_id|>user<|end_header_id|>\n\n"
+                       << prompt << "<|eot_id|><|start_header_id|>assistant<|end_header_id|>\n\n";
+            break;
+        }
+        if (bpe_chat_format == BPE_CHAT_UNKNOWN)
+        {
+            oss_prompt << prompt;
+            break;
+        }
+        [[fallthrough]];
+    case TKT_Qwen:
+        oss_prompt << "<|im_end|>\n<|im_start|>user\n"
+                   << prompt << "<|im_end|>\n<|im_start|>assistant\n";
+        break;
+    case TKT_HTTP:
+    default:
+        oss_prompt << prompt;
+        break;
+    }
+
+    return oss_prompt.str();
+}
+
 int main(int argc, char *argv[])
 {
     signal(SIGPIPE, SIG_IGN);
@@ -56,24 +117,7 @@ int main(int argc, char *argv[])
 
     cmdline::parser cmd;
     cmd.add<std::string>("prompt", 'p', "prompt", true, prompt);
-    cmd.add<std::string>("template_filename_axmodel", 0, "axmodel path template", false, attr.template_filename_axmodel);
-    cmd.add<std::string>("filename_post_axmodel", 0, "post axmodel path", false, attr.filename_post_axmodel);
-    cmd.add<int>("tokenizer_type", 0, "tokenizer type 0:LLaMa 1:Qwen 2:HTTP 3:Phi3 4:MINICPM", false, attr.tokenizer_type);
-    cmd.add<std::string>("filename_tokenizer_model", 0, "tokenizer model path", false, attr.filename_tokenizer_model);
-    cmd.add<std::string>("filename_tokens_embed", 0, "tokens embed path", false, attr.filename_tokens_embed);
-
-    cmd.add<bool>("use_topk", 0, "", false, attr.b_use_topk);
-
-    cmd.add<bool>("bos", 0, "", false, attr.b_bos);
-    cmd.add<bool>("eos", 0, "", false, attr.b_eos);
-    cmd.add<int>("axmodel_num", 0, "num of axmodel(for template)", false, attr.axmodel_num);
-    cmd.add<int>("tokens_embed_num", 0, "tokens embed num", false, attr.tokens_embed_num);
-    cmd.add<int>("tokens_embed_size", 0, "tokens embed size", false, attr.tokens_embed_size);
-
-    cmd.add<bool>("use_mmap_load_embed", 0, "it can save os memory", false, attr.b_use_mmap_load_embed);
-    cmd.add<bool>("dynamic_load_axmodel_layer", 0, "it can save cmm memory", false, attr.b_dynamic_load_axmodel_layer);
-
-    cmd.add<std::string>("post_config_path", 0, "post config path", false, attr.post_config_path);
+    add_llm_options(cmd, attr);
 
     cmd.add<bool>("live_print", 0, "print in live if set true, else print in end", false);
 
@@ -82,22 +126,7 @@ int main(int argc, char *argv[])
     cmd.parse_check(argc, argv);
 
     prompt = cmd.get<std::string>("prompt");
-    attr.tokenizer_type = (TokenizerType)cmd.get<int>("tokenizer_type");
-    attr.filename_tokenizer_model = cmd.get<std::string>("filename_tokenizer_model");
-    attr.filename_tokens_embed = cmd.get<std::string>("filename_tokens_embed");
-    attr.filename_post_axmodel = cmd.get<std::string>("filename_post_axmodel");
-    attr.template_filename_axmodel = cmd.get<std::string>("template_filename_axmodel");
-    attr.b_use_topk = cmd.get<bool>("use_topk");
-    attr.b_bos = cmd.get<bool>("bos");
-    attr.b_eos = cmd.get<bool>("eos");
-    attr.axmodel_num = cmd.get<int>("axmodel_num");
-    attr.tokens_embed_num = cmd.get<int>("tokens_embed_num");
-    attr.tokens_embed_size = cmd.get<int>("tokens_embed_size");
-
-    attr.b_use_mmap_load_embed = cmd.get<bool>("use_mmap_load_embed");
-    attr.b_dynamic_load_axmodel_layer = cmd.get<bool>("dynamic_load_axmodel_layer");
-
-    attr.post_config_path = cmd.get<std::string>("post_config_path");
+    get_llm_options(cmd, attr);
 
     bool b_live_print = cmd.get<bool>("live_print");
     if (b_live_print)
@@ -112,6 +141,20 @@ int main(int argc, char *argv[])
     {
         return -1;
     }
+    bpe_chat_format = detect_bpe_chat_format(lLaMa, attr.tokenizer_type);
+    if (attr.tokenizer_type == TKT_BPE && bpe_chat_format == BPE_CHAT_UNKNOWN)
+    {
+        ALOGW("no <|im_start|> or <|start_header_id|> in tokenizer, prompt is used without chat template");
+    }
+
+    if (!init_draft_model(cmd, attr, draft))
+    {
+        return -1;
+    }
+    if (draft)
+    {
+        lLaMa.SetDraftModel(draft);
+    }
 
     if (prompt != "")
     {
@@ -123,8 +166,7 @@ int main(int argc, char *argv[])
     //
     if (b_continue)
     {
-        printf("Type \"q\" to exit, Ctrl+c to stop current running\n");
-        // lLaMa.Reset();
+        printf("Type \"q\" to exit, \"reset\" to clear history, Ctrl+c to stop current running\n");
     }
 
     while (b_continue)
@@ -141,11 +183,34 @@ int main(int argc, char *argv[])
         {
             continue;
         }
-        auto output = lLaMa.Run(prompt_complete(input, attr.tokenizer_type));
+        if (input == "reset")
+        {
+            lLaMa.Reset();
+            continue;
+        }
+        std::string output;
+        if (lLaMa.GetHistoryLen() == 0)
+        {
+            output = lLaMa.Run(prompt_complete(input, attr.tokenizer_type));
+        }
+        else
+        {
+            output = lLaMa.RunContinue(prompt_continue(input, attr.tokenizer_type));
+            if (lLaMa.GetRunStats().b_context_full)
+            {
+                printf("history is too long, start a new session\n");
+                output = lLaMa.Run(prompt_complete(input, attr.tokenizer_type));
+            }
+        }
         if (!b_live_print)
             printf("%s\n", output.c_str());
     }
 
+    lLaMa.SetDraftModel(nullptr);
+    if (draft)
+    {
+        draft->Deinit();
+    }
     lLaMa.Deinit();
 
     return 0;
@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <cmath>
 #include <numeric>
+#include <atomic>
 #include "bfloat16.hpp"
 #include "Tokenizer/Tokenizer.hpp"
 #include "LLMEmbedSelector.hpp"
@@ -11,6 +12,8 @@
 #include "cqdm.h"
 #include "timer.hpp"
 #include "LLMPostprocess.hpp"
+#include "LLMLayerPrefetcher.hpp"
+#include "thread_pool.hpp"
 
 #include <ax_sys_api.h>
 
@@ -23,10 +26,11 @@ struct LLMAttrType
 
     // std::string template_prefill_filename_axmodel = "minicpmv/prefill_axmodel/minicpm_p96_l%d.axmodel";
     // int prefill_axmodel_num = 40;
-    int prefill_token_num = 96; // auto calc
+    int prefill_token_num = 96; // auto calc, 所有 prefill 组中最大的窗口
 
     std::string filename_post_axmodel = "tinyllama-int8/tinyllama_post.axmodel";
 
+    // post 模型在 NPU 上做 top-k：只输出 indices 时直接取第一个（贪心），同时输出 values 时在 K 个候选上采样
     bool b_use_topk = false;
 
     // std::string filename_vpm_resampler_axmodedl = "minicpmv/vpm_resampler_version0_fp16.axmodel";
@@ -36,6 +40,8 @@ struct LLMAttrType
     TokenizerType tokenizer_type = TKT_LLaMa;
     std::string filename_tokenizer_model = "tokenizer.model";
     bool b_bos = true, b_eos = false;
+    // tokenizer 缓存最近用过的 BPE 片段的条数，0 表示不缓存，目前只有 Qwen(tiktoken) 支持
+    int tokenizer_cache_capacity = 4096;
     std::string filename_tokens_embed = "tinyllama.model.embed_tokens.weight.bfloat16.bin";
     int tokens_embed_num = 32000;
     int tokens_embed_size = 2048;
@@ -45,18 +51,70 @@ struct LLMAttrType
     int kv_cache_num = 1024; // auto calc
     int kv_cache_size = 256; // auto calc
 
+    int prefill_max_kv_cache_num = 0; // auto calc, prefill 组可接收的最长历史 kv cache，0 表示不支持带历史的 prefill
+
     bool b_use_mmap_load_embed = false;
+    // Init 时并行加载 tokenizer、embed 和各层模型的线程数，1 表示串行
+    int init_thread_num = 4;
     bool b_dynamic_load_axmodel_layer = false;
 
     bool b_use_mmap_load_layer = true;
+    // 动态加载时常驻 handle 可用的 CMM 预算(MB)，决定后台预取的层数；0 表示只预取下一层，<0 表示不预取
+    int dynamic_load_cmm_budget = 0;
+    // 动态加载时所有层可占用的 CMM 总预算(MB)，预算内的层常驻，其余层动态加载；0 表示全部动态加载
+    int layer_cmm_budget = 0;
+
+    // 层与层之间直接绑定 CMM 缓冲区传递 hidden state，不经过 host 内存
+    bool b_zero_copy_hidden_state = true;
+    // K_cache_out/V_cache_out 直接写进 decode 组 K_cache/V_cache 的对应行，prefill 组的历史也直接读取 decode 组的 K_cache/V_cache
+    bool b_kv_cache_inplace = true;
+    // 所有层共用第 0 层的 mask/indices（以及未绑定时的 input）缓冲区，mask 按步增量更新
+    bool b_share_layer_inputs = true;
+    // decode 时异步提交 NPU 推理，推理期间准备下一层的输入，并执行上一个 token 的 detokenize 和回调；
+    // 每层多一次线程切换，回调推迟一步，在 AX650 上实测 decode 速度有提升之前默认关闭
+    bool b_async_inference = false;
 
     std::string post_config_path = "post_config.json";
 
+    // 投机解码每轮最多提出的草稿 token 数，草稿来自 SetDraftModel 设置的草稿模型或 prompt lookup
+    int speculative_k = 4;
+    // 没有草稿模型时，用上下文末尾的 n-gram 在 prompt 和已生成的 token 中查找后续作为草稿，
+    // 从 prompt_lookup_ngram 到 prompt_lookup_min_ngram 依次尝试
+    bool b_prompt_lookup = false;
+    int prompt_lookup_ngram = 3;
+    int prompt_lookup_min_ngram = 2;
+
+    // 每次生成最多输出的 token 数，<= 0 表示只受 max_token_len 限制
+    int max_new_tokens = -1;
+
     // bool b_live_print = true;
     LLMRuningCallback runing_callback = nullptr;
     void *reserve = nullptr;
 };
 
+// 最近一次生成的统计
+struct LLMRunStats
+{
+    int prompt_tokens = 0;
+    int completion_tokens = 0;
+    bool b_hit_eos = false;
+    bool b_context_full = false; // RunContinue 时历史加上本轮输入超过 max_token_len，没有运行，需要 Reset 后带上完整的 prompt 重新运行
+    float ttft_ms = 0;
+    float token_per_sec = 0;
+    std::vector<int> output_ids; // 生成的 token，不含 eos
+};
+
+// 保存在 host 内存中的会话，用于抢占：每层 K/V 的前 history_len 行、采样状态，
+// 以及最后一个已经生成但还没写入 KV 的 token
+struct LLMSession
+{
+    int history_len = 0;
+    int last_token = -1;
+    std::vector<std::vector<unsigned short>> k_caches, v_caches;
+    LLMPostprocess postprocess;
+    std::vector<int> spec_context;
+};
+
 class LLM
 {
 private:
@@ -65,34 +123,95 @@ private:
 
     LLMAttrType _attr;
 
+    // 一个组的输入输出 tensor，按名字解析一次后保存指针，推理循环中不再按名字查找；
+    // 指针指向 runner 内部的 tensor，绑定缓冲区后其中的地址同步更新，模型中没有的 tensor 为 nullptr
+    struct LLMLayerIO
+    {
+        const ax_runner_tensor_t *indices = nullptr, *mask = nullptr, *input = nullptr;
+        const ax_runner_tensor_t *k_cache = nullptr, *v_cache = nullptr;
+        const ax_runner_tensor_t *k_cache_out = nullptr, *v_cache_out = nullptr, *output = nullptr;
+        int k_cache_out_idx = -1, v_cache_out_idx = -1;
+    };
+
     struct LLMLayer
     {
         ax_runner_ax650 layer;
         std::string filename;
         MMap layer_buffer;
         std::vector<char> layer_buffer_vec;
+
+        bool b_resident = false; // 动态加载模式下常驻，不参与动态加载
+        bool b_io_bound_checked = false;
+        bool b_input_bound = false; // input 已绑定到上一层的 output
+        bool b_kv_inplace = false;  // K/V 输出原地写入 K_cache/V_cache
+        bool b_inputs_shared = false; // mask/indices 绑定到第 0 层的缓冲区
+        std::vector<LLMLayerIO> io; // 按 grpid 索引，IO 分配后解析一次
     };
 
     std::vector<LLMLayer> llama_layers;
+    LLMRunStats run_stats;
+    // 异步推理时回调推迟到下一次 decode 第 0 层推理期间执行
+    std::vector<int> pending_callback_tokens;
+    float pending_callback_speed = 0;
+    LLMLayerPrefetcher layer_prefetcher;
     ax_runner_ax650 llama_post;
+    bool b_post_input_bound = false; // post 的 input 已绑定到最后一层 decode 组的 output
+    const ax_runner_tensor_t *post_input = nullptr, *post_output = nullptr, *post_output_indices = nullptr, *post_output_values = nullptr;
+
+    // b_use_topk 时 post 模型输出的候选数，以及 values 的数据类型，没有 values 输出时 post_topk_values_size 为 0
+    int post_topk_num = 0;
+    int post_topk_values_size = 0;
+    std::vector<std::pair<int, float>> post_candidates;
+
+    // 模型可以编译出多个不同窗口/历史长度的 prefill 组，按开销从小到大排列
+    struct LLMPrefillGroup
+    {
+        int grpid;
+        int token_num;
+        int max_kv_cache_num;
+    };
+    std::vector<LLMPrefillGroup> prefill_groups;
 
-    int prefill_grpid = 1;
     int decode_grpid = 0;
 
     // ax_runner_ax650 vpm_resampler;
 
     // std::vector<std::vector<unsigned short>> k_caches, v_caches;
 
-    bool b_stop = false;
+    // 会话状态：已经写入 K_cache/V_cache 的 token 数，以及 decode 组对应的 mask
+    int history_len = 0;
+    std::vector<unsigned short> decode_mask;
+
+    // 其他线程调用 Stop 打断推理
+    std::atomic<bool> b_stop{false};
+    // 最近一次生成的第一个 token 在 KV 中的位置，SaveSession 用来找到最后一个 token 的位置
+    int run_output_begin = 0;
+    // RunResume 恢复的会话接着生成，不清空惩罚计数
+    bool b_resume_session = false;
+    // 上一轮没有以 eos 结束（max_new_tokens、Stop）时，最后输出的 token 还没有写入 KV，下一轮 RunContinue 时放在输入最前面补上；
+    // continue_history_len 为它在 KV 中的位置
+    int continue_token = -1;
+    int continue_history_len = 0;
+
+    // 投机解码：草稿模型的 KV 比本模型少 spec_draft_pending 这几个 token，输入不带 token id 时失去同步，直到 Reset
+    std::shared_ptr<LLM> spec_draft;
+    bool b_spec_synced = true;
+    std::vector<int> spec_draft_pending;
+    std::vector<int> spec_feed, spec_drafts;
+    std::vector<unsigned short> spec_embed;
+    int spec_step_k = 0, spec_draft_base = 0;
+    bool b_spec_step_draft = false;
+    // 会话中已知的 token（输入和生成的），prompt lookup 在其中查找草稿
+    std::vector<int> spec_context;
+    int spec_draft_num = 0, spec_accept_num = 0;
 
     LLMPostprocess postprocess;
-    static int post_process(LLMPostprocess &postprocess, unsigned short *p, int n, std::vector<int> &history, float *val = 0)
+    static int post_process(LLMPostprocess &postprocess, unsigned short *p, int n, float *val = 0)
     {
-        std::vector<float> logits(n);
-        for (int i = 0; i < n; i++)
+        // 不需要修改 logits 时直接在 bf16 输出上求最大值，转换和 argmax 一次遍历完成
+        if (postprocess.is_greedy())
         {
-            unsigned int proc = p[i] << 16;
-            logits[i] = *reinterpret_cast<float *>(&proc);
+            return argmax_bfloat16(p, n, val);
         }
 
         // postprocess.set_temperature(true, 0.9f);
@@ -100,7 +219,8 @@ private:
         // postprocess.set_top_k_sampling(true, 10);
         // // postprocess.set_top_p_sampling(true, 0.9f);
 
-        return postprocess.apply(logits, history);
+        // 其余情况在 bf16 输出上单次遍历完成惩罚、temperature 和候选筛选
+        return postprocess.apply(p, n);
 
         // float max_val = -MAXFLOAT;
         // int max_index = 0;
@@ -125,11 +245,77 @@ public:
         ALOGI("LLM init start");
         t_cqdm cqdm = create_cqdm(attr.axmodel_num + 3, 32);
         this->_attr = attr;
-        tokenizer = CreateTokenizer(attr.tokenizer_type);
-        if (!tokenizer->Init(attr.filename_tokenizer_model, attr.b_bos, attr.b_eos))
+        timer t_init;
+
+        // tokenizer、embed、各层和 post 模型互不依赖，放进线程池并行加载，主线程按顺序收集结果并打印进度
+        // 每个任务记录自己的耗时，最后汇总各阶段耗时
+        ThreadPool pool(attr.init_thread_num);
+        float t_tokenizer = 0, t_embed = 0, t_post = 0;
+        std::vector<float> t_layers(attr.axmodel_num, 0);
+
+        auto tokenizer_future = pool.enqueue([&]
+                                             {
+            timer t;
+            tokenizer = CreateTokenizer(attr.tokenizer_type);
+            bool ret = tokenizer && tokenizer->Init(attr.filename_tokenizer_model, attr.b_bos, attr.b_eos);
+            if (ret)
+            {
+                tokenizer->SetCacheCapacity(std::max(0, attr.tokenizer_cache_capacity));
+            }
+            t_tokenizer = t.cost();
+            return ret; });
+
+        auto embed_future = pool.enqueue([&]
+                                         {
+            timer t;
+            bool ret = embed_selector.Init(attr.filename_tokens_embed, attr.tokens_embed_num, attr.tokens_embed_size, attr.b_use_mmap_load_embed);
+            t_embed = t.cost();
+            return ret; });
+
+        llama_layers.resize(attr.axmodel_num);
+        // prefill_layers.resize(attr.prefill_axmodel_num);
+
+        char axmodel_path[1024];
+        std::vector<std::future<bool>> layer_futures;
+        for (int i = 0; i < attr.axmodel_num; i++)
+        {
+            sprintf(axmodel_path, attr.template_filename_axmodel.c_str(), i);
+            llama_layers[i].filename = axmodel_path;
+
+            layer_futures.push_back(pool.enqueue([&, i]
+                                                 {
+                timer t;
+                auto &layer = llama_layers[i];
+                bool ret = true;
+                if (!attr.b_dynamic_load_axmodel_layer)
+                {
+                    ret = layer.layer.init(layer.filename.c_str(), false) == 0;
+                }
+                else if (!attr.b_use_mmap_load_layer)
+                {
+                    ret = read_file(layer.filename, layer.layer_buffer_vec);
+                }
+                else
+                {
+                    ret = layer.layer_buffer.open_file(layer.filename.c_str());
+                }
+                t_layers[i] = t.cost();
+                return ret; }));
+        }
+
+        auto post_future = pool.enqueue([&]
+                                        {
+            timer t;
+            bool ret = llama_post.init(attr.filename_post_axmodel.c_str(), false) == 0;
+            t_post = t.cost();
+            return ret; });
+
+        // 出错也要等所有任务结束再返回，任务里引用了局部变量
+        bool b_init_ok = true;
+        if (!tokenizer_future.get())
         {
             ALOGE("tokenizer.Init(%s, %d, %d) failed", attr.filename_tokenizer_model.c_str(), attr.b_bos, attr.b_eos);
-            return false;
+            b_init_ok = false;
         }
         update_cqdm(&cqdm, 0, "count", "tokenizer init ok");
         // test code
@@ -144,97 +330,75 @@ public:
         //     printf("\n");
         // }
 
-        if (!embed_selector.Init(attr.filename_tokens_embed, attr.tokens_embed_num, attr.tokens_embed_size, attr.b_use_mmap_load_embed))
+        if (!embed_future.get())
         {
             ALOGE("embed_selector.Init(%s, %d, %d) failed", attr.filename_tokens_embed.c_str(), attr.tokens_embed_num, attr.tokens_embed_size);
-            return false;
+            b_init_ok = false;
         }
         update_cqdm(&cqdm, 1, "count", "embed_selector init ok");
-        // test code
-        // {
-        //     std::vector<unsigned short> embed = embed_selector.getByIndex(123);
-        //     printf("embed size: %d\n", embed.size());
-        //     for (int i = 0; i < embed.size(); i++)
-        //     {
-        //         bfloat16 bf16 = bfloat16(embed[i]);
-        //         float val = bf16;
-        //         printf("%d %0.22f\n", embed[i], val);
-        //     }
-        // }
 
-        llama_layers.resize(attr.axmodel_num);
-        // prefill_layers.resize(attr.prefill_axmodel_num);
-
-        char axmodel_path[1024];
         for (int i = 0; i < attr.axmodel_num; i++)
         {
-            sprintf(axmodel_path, attr.template_filename_axmodel.c_str(), i);
-            llama_layers[i].filename = axmodel_path;
-
+            if (!layer_futures[i].get())
+            {
+                ALOGE("%s axmodel(%s) failed", attr.b_dynamic_load_axmodel_layer ? "read" : "init", llama_layers[i].filename.c_str());
+                b_init_ok = false;
+                continue;
+            }
             if (!attr.b_dynamic_load_axmodel_layer)
             {
-                int ret = llama_layers[i].layer.init(llama_layers[i].filename.c_str(), false);
-                if (ret != 0)
-                {
-                    ALOGE("init axmodel(%s) failed", llama_layers[i].filename.c_str());
-                    return false;
-                }
-                int remain_cmm = get_remaining_cmm_size();
-                sprintf(axmodel_path, "init %d axmodel ok,remain_cmm(%d MB)", i, remain_cmm);
-                update_cqdm(&cqdm, i + 2, "count", axmodel_path);
+                // 各层并行加载，这里读到的剩余 CMM 已经是全部加载后的值，只在最后打印一次
+                sprintf(axmodel_path, "init %d axmodel ok", i);
             }
             else
             {
-                if (!attr.b_use_mmap_load_layer)
-                {
-                    if (!read_file(llama_layers[i].filename, llama_layers[i].layer_buffer_vec))
-                    {
-                        ALOGE("read_file(%s) failed", llama_layers[i].filename.c_str());
-                        return false;
-                    }
-                }
-                else
-                {
-                    llama_layers[i].layer_buffer.open_file(llama_layers[i].filename.c_str());
-                }
-
                 sprintf(axmodel_path, "read_file %s ok", llama_layers[i].filename.c_str());
-                update_cqdm(&cqdm, i + 2, "count", axmodel_path);
             }
+            update_cqdm(&cqdm, i + 2, "count", axmodel_path);
         }
 
-        int ret = llama_post.init(attr.filename_post_axmodel.c_str(), false);
-        if (ret != 0)
+        if (!post_future.get())
         {
             ALOGE("init post axmodel(%s) failed", attr.filename_post_axmodel.c_str());
+            b_init_ok = false;
+        }
+        if (!b_init_ok)
+        {
             return false;
         }
+        // 所有层和 post 模型都加载完成后的剩余 CMM
         int remain_cmm = get_remaining_cmm_size();
         sprintf(axmodel_path, "init post axmodel ok,remain_cmm(%d MB)", remain_cmm);
         update_cqdm(&cqdm, attr.axmodel_num + 2, "count", axmodel_path);
 
+        post_input = llama_post.find_input(0, "input");
+        post_output = llama_post.find_output(0, "output");
+        if (attr.b_use_topk && !init_post_topk())
+        {
+            return false;
+        }
+
+        float t_load = t_init.cost();
+        float t_layer_sum = std::accumulate(t_layers.begin(), t_layers.end(), 0.f);
+        float t_layer_max = t_layers.empty() ? 0.f : *std::max_element(t_layers.begin(), t_layers.end());
+        ALOGI("init stage(ms) tokenizer: %.2f, embed: %.2f, layers: %.2f (max %.2f), post: %.2f, wall: %.2f, threads: %d",
+              t_tokenizer, t_embed, t_layer_sum, t_layer_max, t_post, t_load, attr.init_thread_num);
+
         // int remain_cmm = get_remaining_cmm_size();
         // sprintf(axmodel_path, "init vpm axmodel ok,remain_cmm(%d MB)", remain_cmm);
         // update_cqdm(&cqdm, attr.axmodel_num + 2, "count", axmodel_path);
 
+        int remain_cmm_loaded = remain_cmm;
         if (attr.b_dynamic_load_axmodel_layer)
         {
             // 加载第一层获取shape信息
-            auto &layer = llama_layers[0];
-            int ret;
-            if (_attr.b_use_mmap_load_layer)
-            {
-                ret = layer.layer.init((char *)layer.layer_buffer.data(), layer.layer_buffer.size());
-            }
-            else
+            if (init_layer_handle(0) != 0)
             {
-                ret = layer.layer.init(layer.layer_buffer_vec.data(), layer.layer_buffer_vec.size());
-            }
-            if (ret != 0)
-            {
-                ALOGE("init axmodel(%s) failed", layer.filename.c_str());
+                return false;
             }
+            remain_cmm_loaded = get_remaining_cmm_size();
         }
+        resolve_layer_io(0);
 
         {
             _attr.max_token_len = llama_layers[0].layer.get_input("mask").nSize / sizeof(unsigned short) - 1;
@@ -249,23 +413,83 @@ public:
                 ALOGE("max_token_len(%d) > kv_cache_num(%d)", _attr.max_token_len, _attr.kv_cache_num);
                 return false;
             }
+            // tokens_embed_size 与模型不符时 embedding 会被按错误的维度读取
+            int input_embed_size = llama_layers[0].layer.get_input("input").nSize / sizeof(unsigned short);
+            if (input_embed_size != _attr.tokens_embed_size)
+            {
+                ALOGE("tokens_embed_size(%d) != axmodel input size(%d)", _attr.tokens_embed_size, input_embed_size);
+                return false;
+            }
 
-            _attr.prefill_token_num = llama_layers[0].layer.get_input(prefill_grpid, "indices").vShape[1];
-            ALOGI("prefill_token_num : %d", _attr.prefill_token_num);
+            // 除 decode 组外的其余组都是 prefill 组
+            // prefill 组的 mask 为 [token_num, max_kv_cache_num + token_num]，旧模型没有历史部分
+            prefill_groups.clear();
+            _attr.prefill_token_num = 0;
+            _attr.prefill_max_kv_cache_num = 0;
+            for (int grpid = 0; grpid < llama_layers[0].layer.get_num_groups(); grpid++)
+            {
+                if (grpid == decode_grpid)
+                {
+                    continue;
+                }
+                LLMPrefillGroup group;
+                group.grpid = grpid;
+                group.token_num = llama_layers[0].layer.get_input(grpid, "indices").vShape[1];
+                int mask_cols = llama_layers[0].layer.get_input(grpid, "mask").nSize / sizeof(unsigned short) / group.token_num;
+                group.max_kv_cache_num = std::max(0, std::min(mask_cols - group.token_num, _attr.kv_cache_num));
+                ALOGI("prefill grpid %d, token_num : %d, max_kv_cache_num : %d", group.grpid, group.token_num, group.max_kv_cache_num);
+                prefill_groups.push_back(group);
+
+                _attr.prefill_token_num = std::max(_attr.prefill_token_num, group.token_num);
+                _attr.prefill_max_kv_cache_num = std::max(_attr.prefill_max_kv_cache_num, group.max_kv_cache_num);
+            }
+            if (prefill_groups.empty())
+            {
+                ALOGE("no prefill group found");
+                return false;
+            }
+            std::sort(prefill_groups.begin(), prefill_groups.end(), [](const LLMPrefillGroup &a, const LLMPrefillGroup &b)
+                      { return a.token_num + a.max_kv_cache_num < b.token_num + b.max_kv_cache_num; });
+            ALOGI("prefill_token_num : %d, prefill_max_kv_cache_num : %d", _attr.prefill_token_num, _attr.prefill_max_kv_cache_num);
         }
         if (attr.b_dynamic_load_axmodel_layer)
         {
-            auto &layer = llama_layers[0];
-            layer.layer.deinit();
+            // 第 0 层加载前后以及释放 handle 后的剩余 CMM 之差，就是一层 handle 和 IO 各自占用的 CMM
+            llama_layers[0].layer.deinit();
+            int remain_cmm_io = get_remaining_cmm_size();
+            int layer0_handle_mb = 0, layer_io_mb = 0;
+            if (remain_cmm >= 0 && remain_cmm_loaded >= 0 && remain_cmm_io >= 0)
+            {
+                layer0_handle_mb = remain_cmm_io - remain_cmm_loaded;
+                layer_io_mb = remain_cmm - remain_cmm_io;
+            }
+            plan_layer_residency(layer0_handle_mb, layer_io_mb);
+            for (int i = 0; i < attr.axmodel_num; i++)
+            {
+                if (llama_layers[i].b_resident && init_layer_handle(i) != 0)
+                {
+                    return false;
+                }
+            }
+            init_layer_prefetcher();
+        }
+        else
+        {
+            // 动态加载时各层的 IO 在第一次加载时才分配，届时再绑定
+            for (int i = 0; i < attr.axmodel_num; i++)
+            {
+                bind_layer_io(i);
+            }
         }
 
-        if (!postprocess.load_config(attr.post_config_path))
+        if (!attr.post_config_path.empty() && !postprocess.load_config(attr.post_config_path))
         {
             ALOGW("load postprocess config(%s) failed", attr.post_config_path.c_str());
         }
+        postprocess.reserve(_attr.tokens_embed_num);
 
-        // Reset();
-        ALOGI("LLM init ok");
+        Reset();
+        ALOGI("LLM init ok, cost %.2f ms", t_init.cost());
         return true;
     }
 
@@ -276,6 +500,7 @@ public:
 
     void Deinit()
     {
+        layer_prefetcher.Deinit();
         for (int i = 0; i < _attr.axmodel_num; i++)
         {
             llama_layers[i].layer.release();
@@ -284,23 +509,232 @@ public:
         embed_selector.Deinit();
     }
 
-    // void Reset()
-    // {
-    //     k_caches.resize(_attr.axmodel_num, std::vector<unsigned short>(_attr.kv_cache_num * _attr.kv_cache_size, 0));
-    //     v_caches.resize(_attr.axmodel_num, std::vector<unsigned short>(_attr.kv_cache_num * _attr.kv_cache_size, 0));
-    // }
+    // 清空会话，K_cache/V_cache 中的旧数据会被 mask 屏蔽，无需清零
+    void Reset()
+    {
+        history_len = 0;
+        continue_token = -1;
+        postprocess.reset_session();
+        bfloat16 bf16 = -65536.f;
+        decode_mask.assign(_attr.kv_cache_num + 1, bf16.data);
+        decode_mask[_attr.kv_cache_num] = 0;
+        if (_attr.b_share_layer_inputs && !llama_layers.empty())
+        {
+            auto &input_mask = llama_layers[0].layer.get_input(decode_grpid, "mask");
+            memcpy(input_mask.pVirAddr, decode_mask.data(), decode_mask.size() * sizeof(unsigned short));
+        }
+
+        if (spec_draft)
+        {
+            spec_draft->Reset();
+        }
+        b_spec_synced = true;
+        spec_draft_pending.clear();
+        spec_context.clear();
+    }
+
+    // 把会话回滚到前 len 个 token，之后写入的 KV 被 mask 屏蔽，无需清除
+    void Rollback(int len)
+    {
+        len = std::max(0, len);
+        if (len >= history_len)
+        {
+            return;
+        }
+        close_decode_mask(len, history_len);
+        history_len = len;
+    }
+
+    // 设置投机解码的草稿模型，需要和本模型共用 tokenizer（词表一致），传入 nullptr 关闭投机解码
+    void SetDraftModel(std::shared_ptr<LLM> draft)
+    {
+        spec_draft = draft;
+        if (spec_draft && spec_draft->getAttr()->tokens_embed_num != _attr.tokens_embed_num)
+        {
+            ALOGW("draft tokens_embed_num(%d) != tokens_embed_num(%d), make sure they share the same tokenizer",
+                  spec_draft->getAttr()->tokens_embed_num, _attr.tokens_embed_num);
+        }
+        Reset();
+    }
+
+    // 作为草稿模型使用：把 token 写入 KV cache，不采样
+    bool FeedTokens(const std::vector<int> &ids)
+    {
+        if (ids.empty())
+        {
+            return true;
+        }
+        if (history_len + (int)ids.size() >= _attr.max_token_len)
+        {
+            return false;
+        }
+        b_stop = false;
+        std::vector<unsigned short> embed(ids.size() * _attr.tokens_embed_size);
+        for (size_t i = 0; i < ids.size(); i++)
+        {
+            embed_selector.getByIndex(ids[i], embed.data() + i * _attr.tokens_embed_size);
+        }
+        prefill(embed, ids.size());
+        return !b_stop;
+    }
+
+    // 作为草稿模型使用：写入 feed 中的 token，从最后一个 token 的输出开始连续生成最多 k 个草稿，
+    // 最后一个草稿不写入 KV。KV 放不下时减少草稿数，返回草稿数
+    int Propose(const std::vector<int> &feed, int k, std::vector<int> &drafts)
+    {
+        drafts.clear();
+        k = std::min(k, _attr.max_token_len - history_len - (int)feed.size() + 1);
+        if (feed.empty() || k <= 0)
+        {
+            return 0;
+        }
+        b_stop = false;
+
+        spec_embed.resize(feed.size() * _attr.tokens_embed_size);
+        for (size_t i = 0; i < feed.size(); i++)
+        {
+            embed_selector.getByIndex(feed[i], spec_embed.data() + i * _attr.tokens_embed_size);
+        }
+        if (feed.size() > 1)
+        {
+            prefill(spec_embed, feed.size());
+        }
+        else
+        {
+            decode(spec_embed);
+        }
+
+        while (!b_stop)
+        {
+            drafts.push_back(post());
+            if ((int)drafts.size() >= k)
+            {
+                break;
+            }
+            spec_embed.resize(_attr.tokens_embed_size);
+            embed_selector.getByIndex(drafts.back(), spec_embed);
+            decode(spec_embed);
+        }
+        return drafts.size();
+    }
+
+    int GetHistoryLen()
+    {
+        return history_len;
+    }
+
+    const LLMRunStats &GetRunStats()
+    {
+        return run_stats;
+    }
+
+    std::string Decode(const std::vector<int> &ids)
+    {
+        return tokenizer->Decode(ids);
+    }
+
+    int GetTokenID(const std::string &token)
+    {
+        return tokenizer->GetTokenID(token);
+    }
+
+    // 保存被 Stop 打断的生成，之后可以运行别的请求，再用 RunResume 接着生成；
+    // 在 Run/RunContinue 返回后调用，还没生成第一个 token 时返回 false，重新运行即可
+    bool SaveSession(LLMSession &session)
+    {
+        auto &output_ids = run_stats.output_ids;
+        if (run_stats.prompt_tokens == 0 || output_ids.empty())
+        {
+            return false;
+        }
+        // 最后一个 token 可能已经写入 KV（decode 完成、采样前被打断），统一回滚到它之前，恢复时重新写入
+        int len = run_output_begin + (int)output_ids.size() - 1;
+        if (len > history_len)
+        {
+            ALOGE("session history_len(%d) < expected(%d)", history_len, len);
+            return false;
+        }
+        Rollback(len);
+
+        session.history_len = len;
+        session.last_token = output_ids.back();
+        session.k_caches.resize(_attr.axmodel_num);
+        session.v_caches.resize(_attr.axmodel_num);
+        size_t row_num = (size_t)len * _attr.kv_cache_size;
+        for (int m = 0; m < _attr.axmodel_num; m++)
+        {
+            auto &io = llama_layers[m].io[decode_grpid];
+            auto k_cache = (unsigned short *)io.k_cache->pVirAddr;
+            auto v_cache = (unsigned short *)io.v_cache->pVirAddr;
+            session.k_caches[m].assign(k_cache, k_cache + row_num);
+            session.v_caches[m].assign(v_cache, v_cache + row_num);
+        }
+        session.postprocess = postprocess;
+        session.spec_context = spec_context;
+        if (!session.spec_context.empty() && session.spec_context.back() == session.last_token)
+        {
+            // 恢复时 last_token 作为输入再加入
+            session.spec_context.pop_back();
+        }
+        return true;
+    }
+
+    // 恢复 SaveSession 保存的会话并接着生成；回调、max_new_tokens 等按当前 attr，采样参数和状态按保存时的
+    std::string RunResume(const LLMSession &session)
+    {
+        Reset();
+        if (session.history_len + 1 >= _attr.max_token_len || (int)session.k_caches.size() != _attr.axmodel_num)
+        {
+            ALOGE("invalid session, history_len(%d)", session.history_len);
+            run_stats = LLMRunStats();
+            return "";
+        }
+        for (int m = 0; m < _attr.axmodel_num; m++)
+        {
+            auto &io = llama_layers[m].io[decode_grpid];
+            memcpy(io.k_cache->pVirAddr, session.k_caches[m].data(), session.k_caches[m].size() * sizeof(unsigned short));
+            memcpy(io.v_cache->pVirAddr, session.v_caches[m].data(), session.v_caches[m].size() * sizeof(unsigned short));
+        }
+        open_decode_mask(0, session.history_len);
+        history_len = session.history_len;
+        postprocess = session.postprocess;
+        spec_context = session.spec_context;
+        // 草稿模型的 KV 没有保存，本次会话不再使用草稿模型
+        b_spec_synced = false;
+        b_resume_session = true;
+
+        std::vector<unsigned short> embed(_attr.tokens_embed_size);
+        embed_selector.getByIndex(session.last_token, embed);
+        return RunContinue(embed, std::vector<int>{session.last_token});
+    }
+
+    // 采样参数，修改后从下一次生成开始生效
+    LLMPostprocess &getPostprocess()
+    {
+        return postprocess;
+    }
 
     void Stop()
     {
         b_stop = true;
+        if (spec_draft)
+        {
+            spec_draft->Stop();
+        }
     }
 
     int Encode(std::vector<unsigned short> &out_embed, std::string prompt = "What is in the image?")
     {
-        std::vector<int> input_ids = tokenizer->Encode(prompt, true);
-        if (input_ids.size() > _attr.prefill_token_num)
+        std::vector<int> input_ids;
+        return Encode(out_embed, input_ids, prompt);
+    }
+
+    int Encode(std::vector<unsigned short> &out_embed, std::vector<int> &input_ids, std::string prompt)
+    {
+        input_ids = tokenizer->Encode(prompt, true);
+        if (input_ids.size() >= _attr.max_token_len)
         {
-            ALOGE("input_ids(%d) > prefill_token_num(%d)", input_ids.size(), _attr.prefill_token_num);
+            ALOGE("input_ids(%d) >= max_token_len(%d)", input_ids.size(), _attr.max_token_len);
             return -1;
         }
         out_embed.resize(input_ids.size() * _attr.tokens_embed_size);
@@ -317,27 +751,36 @@ public:
 
     std::string Run(std::string input_str)
     {
-        std::vector<unsigned short> test_embed;
-        Encode(test_embed, input_str);
-        return Run(test_embed);
+        Reset();
+        return RunContinue(input_str);
     }
 
     std::string Run(std::vector<unsigned short> test_embed)
     {
-        b_stop = false;
-        std::string final_out;
-
-        bfloat16 bf16 = -65536.f;
-        std::vector<unsigned short> mask(_attr.kv_cache_num + 1, bf16.data);
-        std::vector<unsigned short> mask_p(_attr.prefill_token_num * _attr.prefill_token_num, bf16.data);
+        Reset();
+        return RunContinue(test_embed);
+    }
 
-        for (size_t i = 0; i < _attr.prefill_token_num; i++)
+    // 在当前会话的基础上继续对话，只 prefill 本轮新增的 token；
+    // 历史加上本轮输入超过 max_token_len 时不运行，返回空字符串并设置 GetRunStats().b_context_full
+    std::string RunContinue(std::string input_str)
+    {
+        std::vector<unsigned short> test_embed;
+        std::vector<int> input_ids;
+        if (Encode(test_embed, input_ids, input_str) != 0)
         {
-            for (size_t j = 0; j < i + 1; j++)
-            {
-                mask_p[i * _attr.prefill_token_num + j] = 0;
-            }
+            run_stats = LLMRunStats();
+            return "";
         }
+        return RunContinue(test_embed, input_ids);
+    }
+
+    // input_ids 为 test_embed 对应的 token，投机解码用它同步草稿模型；直接传入 embedding（例如图像特征）时为空
+    std::string RunContinue(std::vector<unsigned short> test_embed, std::vector<int> input_ids = std::vector<int>())
+    {
+        b_stop = false;
+        run_stats = LLMRunStats();
+        std::string final_out;
 
         std::vector<int> cached_token;
         std::vector<int> token_ids;
@@ -345,81 +788,57 @@ public:
         // int len_of_input = token_ids.size();
         int input_embed_num = test_embed.size() / _attr.tokens_embed_size;
         // ALOGI("input_embed_num(%d)", input_embed_num);
-
-        mask[_attr.kv_cache_num] = 0;
-        for (size_t i = 0; i < input_embed_num; i++)
+        if (input_embed_num == 0)
         {
-            mask[i] = 0;
+            ALOGE("input_embed_num(%d) == 0", input_embed_num);
+            return final_out;
         }
-        timer t_cost;
-        timer ttft_timer;
-        ttft_timer.start();
+        int base_len = continue_token >= 0 ? continue_history_len : history_len;
+        int continue_num = continue_token >= 0 ? 1 : 0;
+        if (base_len + continue_num + input_embed_num >= _attr.max_token_len)
+        {
+            // 输入只是接在历史后面的部分，清空历史后单独运行会缺少 system prompt 和模板，交给调用方处理
+            ALOGE("history_len(%d) + input_embed_num(%d) >= max_token_len(%d)", base_len + continue_num, input_embed_num, _attr.max_token_len);
+            run_stats.b_context_full = true;
+            return final_out;
+        }
+        bool b_resume = b_resume_session;
+        b_resume_session = false;
 
-        for (unsigned int m = 0; m < _attr.axmodel_num; m++)
+        if (continue_token >= 0)
         {
-            if (b_stop)
+            if (history_len != continue_history_len)
             {
-                break;
+                // 被 Stop 打断时最后一个 token 可能已经写入 KV，草稿模型的进度无法确定，不再使用
+                Rollback(continue_history_len);
+                b_spec_synced = false;
             }
-
-            auto &layer = llama_layers[m];
-            auto &layer_llama = llama_layers[m];
-
-            if (_attr.b_dynamic_load_axmodel_layer)
+            std::vector<unsigned short> embed(_attr.tokens_embed_size);
+            embed_selector.getByIndex(continue_token, embed);
+            test_embed.insert(test_embed.begin(), embed.begin(), embed.end());
+            if ((int)input_ids.size() == input_embed_num)
             {
-                int ret;
-                if (_attr.b_use_mmap_load_layer)
-                {
-                    ret = layer.layer.init((char *)layer.layer_buffer.data(), layer.layer_buffer.size());
-                }
-                else
+                input_ids.insert(input_ids.begin(), continue_token);
+                // 生成时已经加入过 spec_context，spec_begin_turn 会随输入再加入一次
+                if (!spec_context.empty() && spec_context.back() == continue_token)
                 {
-                    ret = layer.layer.init(layer.layer_buffer_vec.data(), layer.layer_buffer_vec.size());
+                    spec_context.pop_back();
                 }
-                if (ret != 0)
-                {
-                    ALOGE("init axmodel(%s) failed", layer.filename.c_str());
-                }
-            }
-
-            auto &input_indices = layer.layer.get_input(prefill_grpid, "indices");
-            unsigned int *input_indices_ptr = (unsigned int *)input_indices.pVirAddr;
-            for (unsigned int i = 0; i < input_embed_num; i++)
-            {
-                input_indices_ptr[i] = i;
-            }
-
-            auto &input_mask = layer.layer.get_input(prefill_grpid, "mask");
-            memcpy(input_mask.pVirAddr, mask_p.data(), mask_p.size() * sizeof(unsigned short));
-
-            auto &input_input = layer.layer.get_input(prefill_grpid, "input");
-            memcpy(input_input.pVirAddr, test_embed.data(), test_embed.size() * sizeof(unsigned short));
-            if (m == 0)
-            {
-                test_embed.resize(_attr.prefill_token_num * _attr.tokens_embed_size);
             }
+            input_embed_num++;
+            continue_token = -1;
+        }
 
-            layer.layer.inference(prefill_grpid);
-
-            auto &output_k_cache = layer.layer.get_output(prefill_grpid, "K_cache_out");
-            AX_SYS_MinvalidateCache(output_k_cache.phyAddr, output_k_cache.pVirAddr, output_k_cache.nSize);
-            auto &input_k_cache = layer_llama.layer.get_input(decode_grpid, "K_cache");
-            memcpy(input_k_cache.pVirAddr, output_k_cache.pVirAddr, sizeof(unsigned short) * _attr.prefill_token_num * _attr.kv_cache_size);
-
-            auto &output_v_cache = layer.layer.get_output(prefill_grpid, "V_cache_out");
-            AX_SYS_MinvalidateCache(output_v_cache.phyAddr, output_v_cache.pVirAddr, output_v_cache.nSize);
-            auto &input_v_cache = layer_llama.layer.get_input(decode_grpid, "V_cache");
-            memcpy(input_v_cache.pVirAddr, output_v_cache.pVirAddr, sizeof(unsigned short) * _attr.prefill_token_num * _attr.kv_cache_size);
+        timer t_cost;
+        timer ttft_timer;
+        ttft_timer.start();
 
-            auto &output = layer.layer.get_output(prefill_grpid, "output");
-            AX_SYS_MinvalidateCache(output.phyAddr, output.pVirAddr, output.nSize);
-            memcpy(test_embed.data(), output.pVirAddr, test_embed.size() * sizeof(unsigned short));
-            if (_attr.b_dynamic_load_axmodel_layer)
-            {
-                layer.layer.deinit();
-            }
-            // ALOGI("%f %f %f %f %f", bfloat16(embed[0]).fp32(), bfloat16(embed[1]).fp32(), bfloat16(embed[2]).fp32(), bfloat16(embed[3]).fp32(), bfloat16(embed[4]).fp32());
+        prefill(test_embed, input_embed_num);
+        if (b_stop)
+        {
+            return final_out;
         }
+        spec_begin_turn(input_ids, input_embed_num);
 
         // ALOGI("prefill time cost: %.2f s", t_cost.cost() / 1000);
 
@@ -435,132 +854,61 @@ public:
         t_cqdm cqdm = create_cqdm(_attr.max_token_len, 32);
         std::vector<unsigned short> embed(_attr.tokens_embed_size, 0);
 
-        memcpy(embed.data(),
-               test_embed.data() + (input_embed_num - 1) * _attr.tokens_embed_size,
-               _attr.tokens_embed_size * sizeof(unsigned short));
-
         {
-
-            // post process
-            auto &input = llama_post.get_input("input");
-            memcpy(input.pVirAddr, embed.data(), embed.size() * sizeof(unsigned short));
-            llama_post.inference();
-            int max_index;
-            if (_attr.b_use_topk)
-            {
-                AX_SYS_MinvalidateCache(llama_post.get_output("indices").phyAddr, llama_post.get_output("indices").pVirAddr, llama_post.get_output("indices").nSize);
-                max_index = *(int *)llama_post.get_output("indices").pVirAddr;
-            }
-            else
+            if (!b_resume)
             {
-                auto &output_post = llama_post.get_output("output");
-                AX_SYS_MinvalidateCache(output_post.phyAddr, output_post.pVirAddr, output_post.nSize);
-                unsigned short *post_out = (unsigned short *)output_post.pVirAddr;
-                float max_val = -MAXFLOAT;
-                max_index = post_process(postprocess, post_out, _attr.tokens_embed_num, token_ids, &max_val);
+                postprocess.reset_penalty();
             }
-            next_token = max_index;
-
-            token_ids.push_back(max_index);
-            cached_token.push_back(max_index);
-            ALOGI("ttft: %.2f ms", ttft_timer.cost());
+            spec_draft_num = spec_accept_num = 0;
+            run_output_begin = history_len;
+            next_token = post();
+
+            token_ids.push_back(next_token);
+            spec_context.push_back(next_token);
+            postprocess.accept_token(next_token);
+            cached_token.push_back(next_token);
+            run_stats.prompt_tokens = input_embed_num;
+            run_stats.ttft_ms = ttft_timer.cost();
+            ALOGI("ttft: %.2f ms", run_stats.ttft_ms);
         }
         t_cost.start();
 
         bool b_hit_eos = false;
-        for (unsigned int indices = input_embed_num; indices < _attr.max_token_len; indices++)
+        std::vector<int> step_tokens;
+        while (history_len < _attr.max_token_len)
         {
-            if (b_stop)
+            if (b_stop || is_max_new_tokens(token_ids))
             {
                 break;
             }
 
-            // ALOGI("out %d %d", indices, next_token);
-            embed_selector.getByIndex(next_token, embed);
-            // ALOGI("%f %f %f %f %f", bfloat16(embed[0]).fp32(), bfloat16(embed[1]).fp32(), bfloat16(embed[2]).fp32(), bfloat16(embed[3]).fp32(), bfloat16(embed[4]).fp32());
-
-            for (int m = 0; m < _attr.axmodel_num; m++)
+            // 每一步得到一个或多个（投机解码）token，它们之前的 token 都已写入 KV
+            int step_base = history_len;
+            step_tokens.clear();
+            if (!speculative_step(next_token, step_tokens))
             {
+                // ALOGI("out %d %d", indices, next_token);
+                embed_selector.getByIndex(next_token, embed);
+                // ALOGI("%f %f %f %f %f", bfloat16(embed[0]).fp32(), bfloat16(embed[1]).fp32(), bfloat16(embed[2]).fp32(), bfloat16(embed[3]).fp32(), bfloat16(embed[4]).fp32());
+
+                decode(embed);
                 if (b_stop)
                 {
                     break;
                 }
-
-                auto &layer = llama_layers[m];
-
-                if (_attr.b_dynamic_load_axmodel_layer)
-                {
-                    int ret;
-                    if (_attr.b_use_mmap_load_layer)
-                    {
-                        ret = layer.layer.init((char *)layer.layer_buffer.data(), layer.layer_buffer.size());
-                    }
-                    else
-                    {
-                        ret = layer.layer.init(layer.layer_buffer_vec.data(), layer.layer_buffer_vec.size());
-                    }
-                    if (ret != 0)
-                    {
-                        ALOGE("init axmodel(%s) failed", layer.filename.c_str());
-                    }
-                }
-
-                auto &input_k_cache = layer.layer.get_input(decode_grpid, "K_cache");
-                unsigned short *input_k_cache_ptr = (unsigned short *)input_k_cache.pVirAddr;
-                // memcpy(input_k_cache.pVirAddr, k_caches[m].data(), sizeof(unsigned short) * k_caches[m].size());
-                auto &input_v_cache = layer.layer.get_input(decode_grpid, "V_cache");
-                unsigned short *input_v_cache_ptr = (unsigned short *)input_v_cache.pVirAddr;
-                // memcpy(input_v_cache.pVirAddr, v_caches[m].data(), sizeof(unsigned short) * v_caches[m].size());
-
-                auto &input_indices = layer.layer.get_input(decode_grpid, "indices");
-                memcpy(input_indices.pVirAddr, &indices, sizeof(indices));
-
-                auto &input_mask = layer.layer.get_input(decode_grpid, "mask");
-                memcpy(input_mask.pVirAddr, mask.data(), mask.size() * sizeof(unsigned short));
-
-                auto &input_input = layer.layer.get_input(decode_grpid, "input");
-                memcpy(input_input.pVirAddr, embed.data(), embed.size() * sizeof(unsigned short));
-
-                layer.layer.inference(decode_grpid);
-
-                auto &output_k_cache = layer.layer.get_output(decode_grpid, "K_cache_out");
-                AX_SYS_MinvalidateCache(output_k_cache.phyAddr, output_k_cache.pVirAddr, output_k_cache.nSize);
-                memcpy(input_k_cache_ptr + indices * _attr.kv_cache_size, output_k_cache.pVirAddr, sizeof(unsigned short) * _attr.kv_cache_size);
-
-                auto &output_v_cache = layer.layer.get_output(decode_grpid, "V_cache_out");
-                AX_SYS_MinvalidateCache(output_v_cache.phyAddr, output_v_cache.pVirAddr, output_v_cache.nSize);
-                memcpy(input_v_cache_ptr + indices * _attr.kv_cache_size, output_v_cache.pVirAddr, sizeof(unsigned short) * _attr.kv_cache_size);
-
-                auto &output = layer.layer.get_output(decode_grpid, "output");
-                AX_SYS_MinvalidateCache(output.phyAddr, output.pVirAddr, output.nSize);
-                memcpy(embed.data(), output.pVirAddr, embed.size() * sizeof(unsigned short));
-                if (_attr.b_dynamic_load_axmodel_layer)
-                {
-                    layer.layer.deinit();
-                }
-                // ALOGI("%f %f %f %f %f", bfloat16(embed[0]).fp32(), bfloat16(embed[1]).fp32(), bfloat16(embed[2]).fp32(), bfloat16(embed[3]).fp32(), bfloat16(embed[4]).fp32());
+                int max_index = post();
+                postprocess.accept_token(max_index);
+                step_tokens.push_back(max_index);
             }
-            // ALOGI("");
-            mask[indices] = 0;
+            if (b_stop)
             {
-                // post process
-                auto &input = llama_post.get_input("input");
-                memcpy(input.pVirAddr, embed.data(), embed.size() * sizeof(unsigned short));
-                llama_post.inference();
-                int max_index;
-                if (_attr.b_use_topk)
-                {
-                    AX_SYS_MinvalidateCache(llama_post.get_output("indices").phyAddr, llama_post.get_output("indices").pVirAddr, llama_post.get_output("indices").nSize);
-                    max_index = *(int *)llama_post.get_output("indices").pVirAddr;
-                }
-                else
-                {
-                    auto &output_post = llama_post.get_output("output");
-                    AX_SYS_MinvalidateCache(output_post.phyAddr, output_post.pVirAddr, output_post.nSize);
-                    unsigned short *post_out = (unsigned short *)output_post.pVirAddr;
-                    float max_val = -MAXFLOAT;
-                    max_index = post_process(postprocess, post_out, _attr.tokens_embed_num, token_ids, &max_val);
-                }
+                break;
+            }
+
+            int n_used = 0;
+            for (int max_index : step_tokens)
+            {
+                n_used++;
                 next_token = max_index;
 
                 if (tokenizer->isEnd(max_index))
@@ -569,14 +917,13 @@ public:
                     {
                         float t_cost_ms = t_cost.cost();
                         float token_per_sec = token_ids.size() / (t_cost_ms / 1000);
-                        auto tmp_out = tokenizer->Decode(cached_token);
-                        _attr.runing_callback(cached_token.data(), cached_token.size(), tmp_out.c_str(), token_per_sec, _attr.reserve);
-                        cached_token.clear();
+                        emit_callback(cached_token, token_per_sec);
                     }
                     b_hit_eos = true;
                     break;
                 }
                 token_ids.push_back(max_index);
+                spec_context.push_back(max_index);
 
                 if (_attr.runing_callback)
                 {
@@ -585,30 +932,1022 @@ public:
                     {
                         float t_cost_ms = t_cost.cost();
                         float token_per_sec = token_ids.size() / (t_cost_ms / 1000);
-                        auto tmp_out = tokenizer->Decode(cached_token);
-                        _attr.runing_callback(cached_token.data(), cached_token.size(), tmp_out.c_str(), token_per_sec, _attr.reserve);
-                        cached_token.clear();
+                        emit_callback(cached_token, token_per_sec);
                     }
                 }
+                if (is_max_new_tokens(token_ids))
+                {
+                    break;
+                }
+            }
+            // 一步确认了多个 token 但中途遇到 eos 或达到 max_new_tokens 时，之后写入的 KV 不再需要
+            if (n_used < step_tokens.size())
+            {
+                spec_commit(step_base, n_used - 1);
             }
 
             if (_attr.runing_callback == nullptr)
-                update_cqdm(&cqdm, indices, "token", "");
+                update_cqdm(&cqdm, history_len, "token", "");
             if (b_hit_eos)
             {
                 break;
             }
         }
+        float t_cost_ms = t_cost.cost();
+        // 没有遇到 eos 时（长度限制、Stop）剩余不足一批的 token 也要回调出去
+        if (cached_token.size() && _attr.runing_callback)
+        {
+            emit_callback(cached_token, token_ids.size() / (t_cost_ms / 1000));
+        }
+        flush_callback();
         printf("\n\n");
         fflush(stdout);
-        float t_cost_ms = t_cost.cost();
-        ALOGN("hit eos,avg %.2f token/s\n", token_ids.size() / (t_cost_ms / 1000));
+        run_stats.completion_tokens = token_ids.size();
+        run_stats.b_hit_eos = b_hit_eos;
+        run_stats.token_per_sec = token_ids.size() / (t_cost_ms / 1000);
+        ALOGN("hit eos,avg %.2f token/s\n", run_stats.token_per_sec);
+        if (spec_draft_num > 0)
+        {
+            ALOGI("speculative decoding accepted %d/%d draft tokens", spec_accept_num, spec_draft_num);
+        }
 
         // 去掉 len_of_input 那部分
         // token_ids.erase(token_ids.begin(), token_ids.begin() + len_of_input);
 
+        if (!b_hit_eos && !token_ids.empty())
+        {
+            continue_token = token_ids.back();
+            continue_history_len = run_output_begin + (int)token_ids.size() - 1;
+        }
+
         final_out = tokenizer->Decode(token_ids);
+        run_stats.output_ids.swap(token_ids);
 
         return final_out;
     }
+
+private:
+    bool is_max_new_tokens(const std::vector<int> &token_ids)
+    {
+        return _attr.max_new_tokens > 0 && (int)token_ids.size() >= _attr.max_new_tokens;
+    }
+
+    // 执行推迟的回调
+    void flush_callback()
+    {
+        if (pending_callback_tokens.empty())
+        {
+            return;
+        }
+        auto tmp_out = tokenizer->Decode(pending_callback_tokens);
+        _attr.runing_callback(pending_callback_tokens.data(), pending_callback_tokens.size(), tmp_out.c_str(), pending_callback_speed, _attr.reserve);
+        pending_callback_tokens.clear();
+    }
+
+    // 输出 tokens 的回调并清空 tokens，异步推理时推迟到下一次 decode 中与 NPU 并行执行，同一时间最多推迟一批
+    void emit_callback(std::vector<int> &tokens, float token_per_sec)
+    {
+        flush_callback();
+        pending_callback_tokens.swap(tokens);
+        tokens.clear();
+        pending_callback_speed = token_per_sec;
+        if (!_attr.b_async_inference)
+        {
+            flush_callback();
+        }
+    }
+
+    size_t get_layer_buffer_size(int m)
+    {
+        auto &layer = llama_layers[m];
+        return _attr.b_use_mmap_load_layer ? layer.layer_buffer.size() : layer.layer_buffer_vec.size();
+    }
+
+    int init_layer_handle(int m)
+    {
+        auto &layer = llama_layers[m];
+        int ret;
+        if (_attr.b_use_mmap_load_layer)
+        {
+            ret = layer.layer.init((char *)layer.layer_buffer.data(), layer.layer_buffer.size());
+        }
+        else
+        {
+            ret = layer.layer.init(layer.layer_buffer_vec.data(), layer.layer_buffer_vec.size());
+        }
+        if (ret != 0)
+        {
+            ALOGE("init axmodel(%s) failed", layer.filename.c_str());
+        }
+        return ret;
+    }
+
+    // 按 layer_cmm_budget 规划哪些层常驻：
+    // 每层 handle 的 CMM 按第 0 层实测值和文件大小等比例估算（测不到时直接用文件大小），
+    // IO 在动态加载时也不释放，所有层的 IO 都要先从预算里扣除，动态加载的层还要留出预取所需的空间。
+    // 每层每个 token 都要跑一遍，没有冷热之分，常驻层均匀穿插在动态加载的层之间，让预取有足够的时间和推理重叠
+    void plan_layer_residency(int layer0_handle_mb, int layer_io_mb)
+    {
+        int layer_num = _attr.axmodel_num;
+        for (auto &layer : llama_layers)
+        {
+            layer.b_resident = false;
+        }
+        if (_attr.layer_cmm_budget <= 0)
+        {
+            return;
+        }
+
+        size_t layer0_size = std::max(size_t(1), get_layer_buffer_size(0));
+        std::vector<int> handle_mb(layer_num);
+        int total_handle_mb = 0, max_handle_mb = 0;
+        for (int m = 0; m < layer_num; m++)
+        {
+            size_t size = get_layer_buffer_size(m);
+            if (layer0_handle_mb > 0)
+            {
+                handle_mb[m] = int(std::ceil(double(layer0_handle_mb) * size / layer0_size));
+            }
+            else
+            {
+                handle_mb[m] = int((size + (1 << 20) - 1) >> 20);
+            }
+            total_handle_mb += handle_mb[m];
+            max_handle_mb = std::max(max_handle_mb, handle_mb[m]);
+        }
+
+        int budget = _attr.layer_cmm_budget - layer_io_mb * layer_num;
+        int resident_num = 0;
+        if (total_handle_mb <= budget)
+        {
+            resident_num = layer_num;
+        }
+        else
+        {
+            int stream_mb = max_handle_mb;
+            if (_attr.dynamic_load_cmm_budget > 0)
+            {
+                stream_mb = std::max(stream_mb, _attr.dynamic_load_cmm_budget);
+            }
+            else if (_attr.dynamic_load_cmm_budget == 0)
+            {
+                stream_mb = 2 * max_handle_mb;
+            }
+            budget -= stream_mb;
+
+            // 能常驻的层数按平均大小估算，再按均匀分布的位置逐个确认
+            int avg_handle_mb = std::max(1, (total_handle_mb + layer_num - 1) / layer_num);
+            int plan_num = std::max(0, std::min(layer_num - 1, budget / avg_handle_mb));
+            for (int i = 0; i < plan_num; i++)
+            {
+                int m = (2 * i + 1) * layer_num / (2 * plan_num);
+                if (handle_mb[m] > budget)
+                {
+                    break;
+                }
+                budget -= handle_mb[m];
+                llama_layers[m].b_resident = true;
+                resident_num++;
+            }
+        }
+        if (resident_num == layer_num)
+        {
+            for (auto &layer : llama_layers)
+            {
+                layer.b_resident = true;
+            }
+        }
+
+        ALOGI("layer cmm budget : %d MB, handle : %d MB/layer, io : %d MB/layer, resident layers : %d/%d",
+              _attr.layer_cmm_budget, max_handle_mb, layer_io_mb, resident_num, layer_num);
+    }
+
+    // 按 CMM 预算计算动态加载的层常驻 handle 的个数，当前推理的层之外的都用于预取
+    void init_layer_prefetcher()
+    {
+        std::vector<bool> b_streamed(_attr.axmodel_num);
+        size_t max_layer_size = 0;
+        for (int m = 0; m < _attr.axmodel_num; m++)
+        {
+            b_streamed[m] = !llama_layers[m].b_resident;
+            if (b_streamed[m])
+            {
+                max_layer_size = std::max(max_layer_size, get_layer_buffer_size(m));
+            }
+        }
+        if (max_layer_size == 0)
+        {
+            return;
+        }
+        if (_attr.dynamic_load_cmm_budget < 0)
+        {
+            ALOGI("dynamic load layer without prefetch");
+            return;
+        }
+        int max_layer_mb = std::max(1, int((max_layer_size + (1 << 20) - 1) >> 20));
+
+        int prefetch_num = 1;
+        if (_attr.dynamic_load_cmm_budget > 0)
+        {
+            prefetch_num = _attr.dynamic_load_cmm_budget / max_layer_mb - 1;
+        }
+        if (prefetch_num <= 0)
+        {
+            ALOGW("cmm budget(%d MB) < 2 layers(%d MB), dynamic load layer without prefetch", _attr.dynamic_load_cmm_budget, max_layer_mb);
+            return;
+        }
+
+        layer_prefetcher.Init(
+            b_streamed, prefetch_num,
+            [this](int m)
+            { return init_layer_handle(m); },
+            [this](int m)
+            {
+                llama_layers[m].layer.deinit();
+                return 0;
+            });
+        ALOGI("dynamic load layer with prefetch : %d, layer size : %d MB", layer_prefetcher.GetPrefetchNum(), max_layer_mb);
+    }
+
+    // 失败时设置 b_stop 并返回 -1，调用方放弃这一步推理
+    int load_layer(int m)
+    {
+        if (!_attr.b_dynamic_load_axmodel_layer)
+        {
+            return 0;
+        }
+        if (!llama_layers[m].b_resident)
+        {
+            int ret;
+            if (layer_prefetcher.GetPrefetchNum() > 0)
+            {
+                ret = layer_prefetcher.Acquire(m);
+            }
+            else
+            {
+                ret = init_layer_handle(m);
+            }
+            if (ret != 0)
+            {
+                ALOGE("load layer %d failed, stop inference", m);
+                b_stop = true;
+                return -1;
+            }
+        }
+        // 后台线程只负责创建 handle，IO 绑定在推理线程中完成
+        bind_layer_io(m);
+        return 0;
+    }
+
+    void unload_layer(int m)
+    {
+        if (!_attr.b_dynamic_load_axmodel_layer || llama_layers[m].b_resident)
+        {
+            return;
+        }
+        if (layer_prefetcher.GetPrefetchNum() > 0)
+        {
+            layer_prefetcher.Release(m);
+        }
+        else
+        {
+            llama_layers[m].layer.deinit();
+        }
+    }
+
+    void resolve_layer_io(int m)
+    {
+        auto &layer = llama_layers[m];
+        if (!layer.io.empty())
+        {
+            return;
+        }
+        layer.io.resize(layer.layer.get_num_groups());
+        for (int grpid = 0; grpid < (int)layer.io.size(); grpid++)
+        {
+            auto &io = layer.io[grpid];
+            io.indices = layer.layer.find_input(grpid, "indices");
+            io.mask = layer.layer.find_input(grpid, "mask");
+            io.input = layer.layer.find_input(grpid, "input");
+            io.k_cache = layer.layer.find_input(grpid, "K_cache");
+            io.v_cache = layer.layer.find_input(grpid, "V_cache");
+            io.k_cache_out = layer.layer.find_output(grpid, "K_cache_out");
+            io.v_cache_out = layer.layer.find_output(grpid, "V_cache_out");
+            io.output = layer.layer.find_output(grpid, "output");
+            io.k_cache_out_idx = layer.layer.get_output_index(grpid, "K_cache_out");
+            io.v_cache_out_idx = layer.layer.get_output_index(grpid, "V_cache_out");
+        }
+    }
+
+    void bind_layer_io(int m)
+    {
+        auto &layer = llama_layers[m];
+        if (layer.b_io_bound_checked)
+        {
+            return;
+        }
+        layer.b_io_bound_checked = true;
+        resolve_layer_io(m);
+
+        if (_attr.b_zero_copy_hidden_state)
+        {
+            bind_hidden_state(m);
+        }
+        if (_attr.b_kv_cache_inplace)
+        {
+            bind_kv_cache(m);
+        }
+        if (_attr.b_share_layer_inputs && m > 0)
+        {
+            share_layer_inputs(m);
+        }
+    }
+
+    // 第 m 层每个组的 mask/indices 绑定到第 0 层的缓冲区，input 没有绑定到上一层时也一起共用，原缓冲区随即释放
+    void share_layer_inputs(int m)
+    {
+        auto &layer = llama_layers[m];
+        auto &first = llama_layers[0];
+        std::vector<std::string> names = {"mask", "indices"};
+        if (!layer.b_input_bound)
+        {
+            names.push_back("input");
+        }
+        for (int grpid = 0; grpid < layer.layer.get_num_groups(); grpid++)
+        {
+            for (auto &name : names)
+            {
+                if (first.layer.get_input(grpid, name).nSize != layer.layer.get_input(grpid, name).nSize)
+                {
+                    ALOGW("layer %d grpid %d %s size mismatch with layer 0, skip sharing", m, grpid, name.c_str());
+                    return;
+                }
+            }
+        }
+        for (int grpid = 0; grpid < layer.layer.get_num_groups(); grpid++)
+        {
+            for (auto &name : names)
+            {
+                auto tensor = first.layer.get_input(grpid, name);
+                layer.layer.bind_input(grpid, name, tensor.phyAddr, tensor.pVirAddr, true);
+            }
+        }
+        layer.b_inputs_shared = true;
+    }
+
+    // 共享输入时所有层共用的第 0 层 decode mask
+    const ax_runner_tensor_t &get_shared_mask()
+    {
+        auto &layer = llama_layers[0];
+        return layer.io.empty() ? layer.layer.get_input(decode_grpid, "mask") : *layer.io[decode_grpid].mask;
+    }
+
+    // 更新 decode mask 的 [begin, end) 为 0，共享输入时同步写入第 0 层的 mask 缓冲区
+    void open_decode_mask(int begin, int end)
+    {
+        unsigned short *p_mask = nullptr;
+        if (_attr.b_share_layer_inputs)
+        {
+            p_mask = (unsigned short *)get_shared_mask().pVirAddr;
+        }
+        for (int i = begin; i < end; i++)
+        {
+            decode_mask[i] = 0;
+            if (p_mask)
+            {
+                p_mask[i] = 0;
+            }
+        }
+    }
+
+    // 把 decode mask 的 [begin, end) 重新屏蔽，用于回滚
+    void close_decode_mask(int begin, int end)
+    {
+        bfloat16 bf16 = -65536.f;
+        unsigned short *p_mask = nullptr;
+        if (_attr.b_share_layer_inputs)
+        {
+            p_mask = (unsigned short *)get_shared_mask().pVirAddr;
+        }
+        for (int i = begin; i < end; i++)
+        {
+            decode_mask[i] = bf16.data;
+            if (p_mask)
+            {
+                p_mask[i] = bf16.data;
+            }
+        }
+    }
+
+    // 新一轮输入 prefill 之后，把草稿模型落后的 token 和本轮输入一起写入草稿模型
+    void spec_begin_turn(const std::vector<int> &input_ids, int input_embed_num)
+    {
+        if ((int)input_ids.size() == input_embed_num)
+        {
+            spec_context.insert(spec_context.end(), input_ids.begin(), input_ids.end());
+        }
+        if (!spec_draft || !b_spec_synced)
+        {
+            return;
+        }
+        if ((int)input_ids.size() != input_embed_num)
+        {
+            ALOGW("input without token ids, speculative decoding is disabled until reset");
+            b_spec_synced = false;
+            return;
+        }
+        spec_feed = spec_draft_pending;
+        spec_feed.insert(spec_feed.end(), input_ids.begin(), input_ids.end());
+        spec_draft_pending.clear();
+        if (!spec_draft->FeedTokens(spec_feed))
+        {
+            ALOGW("draft model kv cache is full, speculative decoding is disabled until reset");
+            b_spec_synced = false;
+        }
+    }
+
+    // prompt lookup：用上下文末尾的 n-gram 在更早的上下文中查找最近一次出现，把它后面的最多 k 个 token 作为草稿
+    int lookup_drafts(int k)
+    {
+        spec_drafts.clear();
+        int len = spec_context.size();
+        const int *ctx = spec_context.data();
+        for (int n = std::min(_attr.prompt_lookup_ngram, len - 1); n >= std::max(1, _attr.prompt_lookup_min_ngram); n--)
+        {
+            const int *suffix = ctx + len - n;
+            for (int start = len - n - 1; start >= 0; start--)
+            {
+                if (std::equal(suffix, suffix + n, ctx + start))
+                {
+                    for (int i = start + n; i < len && (int)spec_drafts.size() < k; i++)
+                    {
+                        spec_drafts.push_back(ctx[i]);
+                    }
+                    return spec_drafts.size();
+                }
+            }
+        }
+        return 0;
+    }
+
+    // 投机解码的一步：草稿模型（或 prompt lookup）提出最多 speculative_k 个 token，本模型用一次 prefill 组推理 [last_token, 草稿...]，
+    // 逐个位置用自己的采样结果和草稿比对，第一个不一致的位置取本模型的结果，之后写入的 KV 回滚。
+    // 每个位置都按本模型自己的采样结果确认，输出与普通解码一致。返回 false 时由调用方按普通方式 decode last_token
+    bool speculative_step(int last_token, std::vector<int> &out)
+    {
+        spec_step_k = 0;
+        b_spec_step_draft = spec_draft && b_spec_synced;
+        if ((!b_spec_step_draft && !_attr.b_prompt_lookup) || _attr.speculative_k <= 0)
+        {
+            return false;
+        }
+
+        int k = std::min(_attr.speculative_k, _attr.max_token_len - history_len - 1);
+        const LLMPrefillGroup *group = k > 0 ? select_prefill_group(k + 1) : nullptr;
+        if (group)
+        {
+            k = std::min(k, group->token_num - 1);
+        }
+
+        bool b_proposed = group && k > 0;
+        if (b_spec_step_draft)
+        {
+            spec_feed = spec_draft_pending;
+            spec_feed.push_back(last_token);
+            spec_draft_base = spec_draft->GetHistoryLen();
+            b_proposed = b_proposed && spec_draft->Propose(spec_feed, k, spec_drafts) > 0;
+            if (!b_proposed)
+            {
+                // 这一步由调用方普通 decode，last_token 只写入本模型
+                spec_draft_pending.push_back(last_token);
+            }
+        }
+        else
+        {
+            b_proposed = b_proposed && lookup_drafts(k) > 0;
+        }
+        if (!b_proposed)
+        {
+            return false;
+        }
+        k = spec_drafts.size();
+        spec_step_k = k;
+
+        int base = history_len;
+        spec_embed.resize((k + 1) * _attr.tokens_embed_size);
+        embed_selector.getByIndex(last_token, spec_embed.data());
+        for (int i = 0; i < k; i++)
+        {
+            embed_selector.getByIndex(spec_drafts[i], spec_embed.data() + (i + 1) * _attr.tokens_embed_size);
+        }
+        prefill_chunk(*group, spec_embed, k + 1);
+        if (b_stop)
+        {
+            return true;
+        }
+
+        for (int i = 0; i <= k; i++)
+        {
+            set_post_input(spec_embed.data() + i * _attr.tokens_embed_size);
+            int token = post();
+            postprocess.accept_token(token);
+            out.push_back(token);
+            if (i == k || token != spec_drafts[i])
+            {
+                break;
+            }
+        }
+        int accepted = out.size() - 1;
+        spec_draft_num += k;
+        spec_accept_num += accepted;
+        spec_commit(base, accepted);
+        return true;
+    }
+
+    // 确认本步 last_token 之后的前 n_keep 个输出 token，回滚之后多写入的 KV，草稿模型同步回滚
+    void spec_commit(int base, int n_keep)
+    {
+        Rollback(base + 1 + n_keep);
+        if (spec_step_k > 0 && b_spec_step_draft)
+        {
+            // 草稿模型写入了 feed 和前 k-1 个草稿，第 k 个草稿被确认时留到下一步再写入
+            spec_draft->Rollback(spec_draft_base + spec_feed.size() + std::min(n_keep, spec_step_k - 1));
+            spec_draft_pending.clear();
+            if (n_keep == spec_step_k)
+            {
+                spec_draft_pending.push_back(spec_drafts[spec_step_k - 1]);
+            }
+        }
+    }
+
+    // 把第 m 层每个组的 input 绑定到第 m-1 层同一组的 output，最后一层 decode 组的 output 再绑定到 post 的 input，
+    // 原 input 缓冲区随即释放；尺寸对不上时保持拷贝方式
+    void bind_hidden_state(int m)
+    {
+        auto &layer = llama_layers[m];
+        if (m > 0)
+        {
+            auto &prev = llama_layers[m - 1];
+            std::vector<ax_runner_tensor_t> prev_outputs;
+            for (int grpid = 0; grpid < layer.layer.get_num_groups(); grpid++)
+            {
+                auto &output = prev.layer.get_output(grpid, "output");
+                if (output.nSize != layer.layer.get_input(grpid, "input").nSize)
+                {
+                    ALOGW("layer %d grpid %d output size(%d) != layer %d input size, skip binding", m - 1, grpid, output.nSize, m);
+                    return;
+                }
+                prev_outputs.push_back(output);
+            }
+            for (int grpid = 0; grpid < layer.layer.get_num_groups(); grpid++)
+            {
+                layer.layer.bind_input(grpid, "input", prev_outputs[grpid].phyAddr, prev_outputs[grpid].pVirAddr, true);
+            }
+            layer.b_input_bound = true;
+        }
+
+        if (m == _attr.axmodel_num - 1)
+        {
+            auto output = layer.layer.get_output(decode_grpid, "output");
+            if (output.nSize == llama_post.get_input("input").nSize)
+            {
+                llama_post.bind_input(0, "input", output.phyAddr, output.pVirAddr, true);
+                b_post_input_bound = true;
+            }
+        }
+    }
+
+    // prefill 组的历史 K_cache/V_cache 输入直接绑定到 decode 组的 K_cache/V_cache（只读前 max_kv_cache_num 行），
+    // 推理时再把 K_cache_out/V_cache_out 绑定到要写入的行上，省掉 host 拷贝和 cache 维护
+    void bind_kv_cache(int m)
+    {
+        auto &layer = llama_layers[m];
+        if ((_attr.kv_cache_size * sizeof(unsigned short)) % AX_CMM_ALIGN_SIZE != 0)
+        {
+            ALOGW("kv_cache_size(%d) is not aligned to %d bytes, copy kv cache instead", _attr.kv_cache_size, AX_CMM_ALIGN_SIZE);
+            return;
+        }
+        if (layer.layer.get_output(decode_grpid, "K_cache_out").nSize != _attr.kv_cache_size * sizeof(unsigned short))
+        {
+            ALOGW("decode K_cache_out is not a single row, copy kv cache instead");
+            return;
+        }
+        auto k_cache = layer.layer.get_input(decode_grpid, "K_cache");
+        auto v_cache = layer.layer.get_input(decode_grpid, "V_cache");
+        for (auto &group : prefill_groups)
+        {
+            if (group.max_kv_cache_num > 0)
+            {
+                layer.layer.bind_input(group.grpid, "K_cache", k_cache.phyAddr, k_cache.pVirAddr, true);
+                layer.layer.bind_input(group.grpid, "V_cache", v_cache.phyAddr, v_cache.pVirAddr, true);
+            }
+        }
+        layer.b_kv_inplace = true;
+    }
+
+    // 下一层（或 post）的 input 是否直接绑定在第 m 层的 output 上
+    bool is_next_input_bound(int m)
+    {
+        if (m + 1 < _attr.axmodel_num)
+        {
+            return llama_layers[m + 1].b_input_bound;
+        }
+        return false;
+    }
+
+    // 把 hidden state 写入 post 的 input，绑定在层输出（cached 内存）上时需要 flush
+    void set_post_input(const unsigned short *hidden)
+    {
+        auto &input = *post_input;
+        memcpy(input.pVirAddr, hidden, _attr.tokens_embed_size * sizeof(unsigned short));
+        if (b_post_input_bound)
+        {
+            AX_SYS_MflushCache(input.phyAddr, input.pVirAddr, input.nSize);
+        }
+    }
+
+    // 在 history_len 之后 prefill input_embed_num 个 token，每个窗口选用最合适的 prefill 组，
+    // test_embed 输入 embedding，最后一个 token 的 hidden state 写入 post 的 input
+    void prefill(std::vector<unsigned short> &test_embed, int input_embed_num)
+    {
+        std::vector<unsigned short> chunk_embed;
+        int start = 0;
+        while (start < input_embed_num && !b_stop)
+        {
+            unsigned short *p_embed = test_embed.data() + start * _attr.tokens_embed_size;
+            const LLMPrefillGroup *group = select_prefill_group(input_embed_num - start);
+            if (!group)
+            {
+                // 没有 prefill 组放得下这么长的历史，退化为逐 token 的 decode
+                chunk_embed.assign(p_embed, p_embed + _attr.tokens_embed_size);
+                decode(chunk_embed);
+                start += 1;
+                continue;
+            }
+
+            int chunk_len = std::min(group->token_num, input_embed_num - start);
+            chunk_embed.assign(p_embed, p_embed + chunk_len * _attr.tokens_embed_size);
+            prefill_chunk(*group, chunk_embed, chunk_len);
+            start += chunk_len;
+            if (start == input_embed_num && !b_stop)
+            {
+                set_post_input(chunk_embed.data() + (chunk_len - 1) * _attr.tokens_embed_size);
+            }
+        }
+    }
+
+    // 选出能容纳当前历史、并且装得下 remain_num 个 token 的开销最小的 prefill 组，
+    // 都装不下时返回窗口最大的组，由调用方继续分块
+    const LLMPrefillGroup *select_prefill_group(int remain_num)
+    {
+        const LLMPrefillGroup *largest = nullptr;
+        for (auto &group : prefill_groups)
+        {
+            if (history_len > group.max_kv_cache_num)
+            {
+                continue;
+            }
+            if (group.token_num >= remain_num)
+            {
+                return &group;
+            }
+            if (!largest || group.token_num > largest->token_num)
+            {
+                largest = &group;
+            }
+        }
+        return largest;
+    }
+
+    // 单个窗口的 prefill，input_embed_num <= group.token_num，K/V 写入 history_len 之后的位置，
+    // test_embed 输入 embedding，输出前 input_embed_num 个 token 最后一层的 hidden state
+    void prefill_chunk(const LLMPrefillGroup &group, std::vector<unsigned short> &test_embed, int input_embed_num)
+    {
+        int prefill_grpid = group.grpid;
+        int prefill_token_num = group.token_num;
+        int precompute_len = history_len;
+        int kv_cache_num = group.max_kv_cache_num;
+        int mask_cols = kv_cache_num + prefill_token_num;
+
+        // 历史部分只放开已有的 precompute_len 个位置，当前部分为下三角
+        bfloat16 bf16 = -65536.f;
+        std::vector<unsigned short> mask_p(prefill_token_num * mask_cols, bf16.data);
+        for (int i = 0; i < prefill_token_num; i++)
+        {
+            unsigned short *mask_ptr = mask_p.data() + i * mask_cols;
+            for (int j = 0; j < precompute_len; j++)
+            {
+                mask_ptr[j] = 0;
+            }
+            for (int j = 0; j < i + 1; j++)
+            {
+                mask_ptr[kv_cache_num + j] = 0;
+            }
+        }
+
+        test_embed.resize(prefill_token_num * _attr.tokens_embed_size);
+
+        for (unsigned int m = 0; m < _attr.axmodel_num; m++)
+        {
+            if (b_stop)
+            {
+                break;
+            }
+
+            if (load_layer(m) != 0)
+            {
+                break;
+            }
+            auto &layer = llama_layers[m];
+            auto &io = layer.io[prefill_grpid];
+            auto &decode_io = layer.io[decode_grpid];
+
+            // 共享输入时只需要写第 0 层
+            if (m == 0 || !layer.b_inputs_shared)
+            {
+                auto &input_indices = *io.indices;
+                unsigned int *input_indices_ptr = (unsigned int *)input_indices.pVirAddr;
+                for (unsigned int i = 0; i < input_embed_num; i++)
+                {
+                    input_indices_ptr[i] = precompute_len + i;
+                }
+
+                auto &input_mask = *io.mask;
+                memcpy(input_mask.pVirAddr, mask_p.data(), mask_p.size() * sizeof(unsigned short));
+            }
+
+            auto &input_k_cache = *decode_io.k_cache;
+            auto &input_v_cache = *decode_io.v_cache;
+            if (precompute_len > 0 && !layer.b_kv_inplace)
+            {
+                auto &prefill_k_cache = *io.k_cache;
+                memcpy(prefill_k_cache.pVirAddr, input_k_cache.pVirAddr, sizeof(unsigned short) * precompute_len * _attr.kv_cache_size);
+                auto &prefill_v_cache = *io.v_cache;
+                memcpy(prefill_v_cache.pVirAddr, input_v_cache.pVirAddr, sizeof(unsigned short) * precompute_len * _attr.kv_cache_size);
+            }
+
+            if (!layer.b_input_bound)
+            {
+                auto &input_input = *io.input;
+                memcpy(input_input.pVirAddr, test_embed.data(), test_embed.size() * sizeof(unsigned short));
+            }
+
+            // 整个窗口（含 padding）都落在 K_cache 范围内时原地写入，padding 行在之后写到该位置前都被 mask 屏蔽
+            bool b_kv_inplace = layer.b_kv_inplace && precompute_len + prefill_token_num <= _attr.kv_cache_num;
+            int k_out_idx = io.k_cache_out_idx;
+            int v_out_idx = io.v_cache_out_idx;
+            if (b_kv_inplace)
+            {
+                size_t offset = precompute_len * _attr.kv_cache_size * sizeof(unsigned short);
+                layer.layer.bind_output(prefill_grpid, k_out_idx, input_k_cache.phyAddr + offset, (char *)input_k_cache.pVirAddr + offset);
+                layer.layer.bind_output(prefill_grpid, v_out_idx, input_v_cache.phyAddr + offset, (char *)input_v_cache.pVirAddr + offset);
+            }
+            else
+            {
+                layer.layer.unbind_output(prefill_grpid, k_out_idx);
+                layer.layer.unbind_output(prefill_grpid, v_out_idx);
+            }
+
+            layer.layer.inference(prefill_grpid);
+
+            if (!b_kv_inplace)
+            {
+                auto &output_k_cache = *io.k_cache_out;
+                AX_SYS_MinvalidateCache(output_k_cache.phyAddr, output_k_cache.pVirAddr, output_k_cache.nSize);
+                memcpy((unsigned short *)input_k_cache.pVirAddr + precompute_len * _attr.kv_cache_size, output_k_cache.pVirAddr, sizeof(unsigned short) * input_embed_num * _attr.kv_cache_size);
+
+                auto &output_v_cache = *io.v_cache_out;
+                AX_SYS_MinvalidateCache(output_v_cache.phyAddr, output_v_cache.pVirAddr, output_v_cache.nSize);
+                memcpy((unsigned short *)input_v_cache.pVirAddr + precompute_len * _attr.kv_cache_size, output_v_cache.pVirAddr, sizeof(unsigned short) * input_embed_num * _attr.kv_cache_size);
+            }
+
+            // 下一层的 input 绑定在这一层的 output 上时 hidden state 留在 CMM 中，最后一层只取有效的行
+            if (m == _attr.axmodel_num - 1)
+            {
+                auto &output = *io.output;
+                AX_SYS_MinvalidateCache(output.phyAddr, output.pVirAddr, output.nSize);
+                memcpy(test_embed.data(), output.pVirAddr, input_embed_num * _attr.tokens_embed_size * sizeof(unsigned short));
+            }
+            else if (!is_next_input_bound(m))
+            {
+                auto &output = *io.output;
+                AX_SYS_MinvalidateCache(output.phyAddr, output.pVirAddr, output.nSize);
+                memcpy(test_embed.data(), output.pVirAddr, test_embed.size() * sizeof(unsigned short));
+            }
+            unload_layer(m);
+            // ALOGI("%f %f %f %f %f", bfloat16(embed[0]).fp32(), bfloat16(embed[1]).fp32(), bfloat16(embed[2]).fp32(), bfloat16(embed[3]).fp32(), bfloat16(embed[4]).fp32());
+        }
+
+        if (b_stop)
+        {
+            return;
+        }
+        open_decode_mask(history_len, history_len + input_embed_num);
+        history_len += input_embed_num;
+    }
+
+    // 使用 decode 组在 history_len 位置推理一个 token，embed 输入 embedding（会被用作中间缓冲区），
+    // 最后一层的 hidden state 写入 post 的 input
+    void decode(std::vector<unsigned short> &embed)
+    {
+        unsigned int indices = history_len;
+        int staged = -1;
+        for (int m = 0; m < _attr.axmodel_num; m++)
+        {
+            if (b_stop)
+            {
+                return;
+            }
+
+            if (load_layer(m) != 0)
+            {
+                return;
+            }
+            auto &layer = llama_layers[m];
+            auto &io = layer.io[decode_grpid];
+
+            auto &input_k_cache = *io.k_cache;
+            unsigned short *input_k_cache_ptr = (unsigned short *)input_k_cache.pVirAddr;
+            // memcpy(input_k_cache.pVirAddr, k_caches[m].data(), sizeof(unsigned short) * k_caches[m].size());
+            auto &input_v_cache = *io.v_cache;
+            unsigned short *input_v_cache_ptr = (unsigned short *)input_v_cache.pVirAddr;
+            // memcpy(input_v_cache.pVirAddr, v_caches[m].data(), sizeof(unsigned short) * v_caches[m].size());
+
+            if (staged != m)
+            {
+                stage_decode_inputs(m, indices);
+            }
+
+            if (!layer.b_input_bound)
+            {
+                auto &input_input = *io.input;
+                memcpy(input_input.pVirAddr, embed.data(), embed.size() * sizeof(unsigned short));
+            }
+
+            if (_attr.b_async_inference)
+            {
+                layer.layer.inference_async(decode_grpid);
+                // NPU 推理期间写入下一层的输入，第 0 层时顺便执行上一批 token 的回调
+                if (m + 1 < _attr.axmodel_num && is_layer_ready(m + 1))
+                {
+                    stage_decode_inputs(m + 1, indices);
+                    staged = m + 1;
+                }
+                if (m == 0)
+                {
+                    flush_callback();
+                }
+                layer.layer.inference_wait();
+            }
+            else
+            {
+                layer.layer.inference(decode_grpid);
+            }
+
+            if (!layer.b_kv_inplace)
+            {
+                auto &output_k_cache = *io.k_cache_out;
+                AX_SYS_MinvalidateCache(output_k_cache.phyAddr, output_k_cache.pVirAddr, output_k_cache.nSize);
+                memcpy(input_k_cache_ptr + indices * _attr.kv_cache_size, output_k_cache.pVirAddr, sizeof(unsigned short) * _attr.kv_cache_size);
+
+                auto &output_v_cache = *io.v_cache_out;
+                AX_SYS_MinvalidateCache(output_v_cache.phyAddr, output_v_cache.pVirAddr, output_v_cache.nSize);
+                memcpy(input_v_cache_ptr + indices * _attr.kv_cache_size, output_v_cache.pVirAddr, sizeof(unsigned short) * _attr.kv_cache_size);
+            }
+
+            bool b_next_bound = m == _attr.axmodel_num - 1 ? b_post_input_bound : is_next_input_bound(m);
+            if (!b_next_bound)
+            {
+                auto &output = *io.output;
+                AX_SYS_MinvalidateCache(output.phyAddr, output.pVirAddr, output.nSize);
+                memcpy(embed.data(), output.pVirAddr, embed.size() * sizeof(unsigned short));
+            }
+            unload_layer(m);
+            // ALOGI("%f %f %f %f %f", bfloat16(embed[0]).fp32(), bfloat16(embed[1]).fp32(), bfloat16(embed[2]).fp32(), bfloat16(embed[3]).fp32(), bfloat16(embed[4]).fp32());
+        }
+        if (!b_post_input_bound)
+        {
+            set_post_input(embed.data());
+        }
+        open_decode_mask(indices, indices + 1);
+        history_len = indices + 1;
+    }
+
+    // 第 m 层的 handle 已创建且 IO 已绑定，可以在上一层推理期间提前写入输入
+    bool is_layer_ready(int m)
+    {
+        auto &layer = llama_layers[m];
+        return (!_attr.b_dynamic_load_axmodel_layer || layer.b_resident) && layer.b_io_bound_checked;
+    }
+
+    // 写入第 m 层 decode 组在 indices 位置推理所需的 indices/mask，原地写 KV 时把 K/V 输出绑定到对应行
+    void stage_decode_inputs(int m, unsigned int indices)
+    {
+        auto &layer = llama_layers[m];
+        auto &io = layer.io[decode_grpid];
+        // 共享输入时 indices 只写第 0 层，mask 已经在第 0 层的缓冲区中增量维护
+        if (m == 0 || !layer.b_inputs_shared)
+        {
+            auto &input_indices = *io.indices;
+            memcpy(input_indices.pVirAddr, &indices, sizeof(indices));
+        }
+        if (!_attr.b_share_layer_inputs || (m > 0 && !layer.b_inputs_shared))
+        {
+            auto &input_mask = *io.mask;
+            memcpy(input_mask.pVirAddr, decode_mask.data(), decode_mask.size() * sizeof(unsigned short));
+        }
+
+        if (layer.b_kv_inplace)
+        {
+            // 当前位置在 mask 中是屏蔽的，NPU 在同一次推理中写入这一行不影响结果
+            auto &input_k_cache = *io.k_cache;
+            auto &input_v_cache = *io.v_cache;
+            size_t offset = indices * _attr.kv_cache_size * sizeof(unsigned short);
+            layer.layer.bind_output(decode_grpid, io.k_cache_out_idx, input_k_cache.phyAddr + offset, (unsigned short *)input_k_cache.pVirAddr + indices * _attr.kv_cache_size, true);
+            layer.layer.bind_output(decode_grpid, io.v_cache_out_idx, input_v_cache.phyAddr + offset, (unsigned short *)input_v_cache.pVirAddr + indices * _attr.kv_cache_size, true);
+        }
+    }
+
+    // 识别 post 模型的 top-k 输出：indices 为 int32[K]，values 按大小区分 bf16[K] 和 fp32[K]
+    bool init_post_topk()
+    {
+        int indices_idx = llama_post.get_output_index(0, "indices");
+        if (indices_idx < 0)
+        {
+            ALOGE("b_use_topk is set, but post axmodel has no indices output");
+            return false;
+        }
+        post_output_indices = &llama_post.get_output(0, indices_idx);
+        post_topk_num = post_output_indices->nSize / sizeof(int);
+        post_topk_values_size = 0;
+
+        int values_idx = llama_post.get_output_index(0, "values");
+        if (values_idx >= 0)
+        {
+            post_output_values = &llama_post.get_output(0, values_idx);
+            int values_nsize = post_output_values->nSize;
+            if (values_nsize == post_topk_num * (int)sizeof(unsigned short) || values_nsize == post_topk_num * (int)sizeof(float))
+            {
+                post_topk_values_size = values_nsize / post_topk_num;
+            }
+            else
+            {
+                ALOGW("post values size(%d) does not match topk(%d), sample greedily", values_nsize, post_topk_num);
+            }
+        }
+        post_candidates.reserve(post_topk_num);
+        ALOGI("post topk : %d, values : %s", post_topk_num,
+              post_topk_values_size == 0 ? "none" : (post_topk_values_size == sizeof(float) ? "fp32" : "bf16"));
+        return true;
+    }
+
+    // 在 post 模型输出的 K 个候选上做惩罚、temperature 和采样，只需要同步 K 个值
+    int post_topk()
+    {
+        auto &output_indices = *post_output_indices;
+        AX_SYS_MinvalidateCache(output_indices.phyAddr, output_indices.pVirAddr, output_indices.nSize);
+        int *p_indices = (int *)output_indices.pVirAddr;
+        if (post_topk_values_size == 0 || postprocess.is_greedy())
+        {
+            return p_indices[0];
+        }
+
+        auto &output_values = *post_output_values;
+        AX_SYS_MinvalidateCache(output_values.phyAddr, output_values.pVirAddr, output_values.nSize);
+        post_candidates.resize(post_topk_num);
+        for (int i = 0; i < post_topk_num; i++)
+        {
+            float val;
+            if (post_topk_values_size == sizeof(float))
+            {
+                val = ((float *)output_values.pVirAddr)[i];
+            }
+            else
+            {
+                val = bfloat16(((unsigned short *)output_values.pVirAddr)[i]);
+            }
+            post_candidates[i] = std::make_pair(p_indices[i], val);
+        }
+        return postprocess.apply(post_candidates);
+    }
+
+    // post 模型根据 input 中的 hidden state 输出下一个 token
+    int post()
+    {
+        llama_post.inference();
+        int max_index;
+        if (_attr.b_use_topk)
+        {
+            max_index = post_topk();
+        }
+        else
+        {
+            auto &output_post = *post_output;
+            AX_SYS_MinvalidateCache(output_post.phyAddr, output_post.pVirAddr, output_post.nSize);
+            unsigned short *post_out = (unsigned short *)output_post.pVirAddr;
+            float max_val = -MAXFLOAT;
+            max_index = post_process(postprocess, post_out, _attr.tokens_embed_num, &max_val);
+        }
+        return max_index;
+    }
 };
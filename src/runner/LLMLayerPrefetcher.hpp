@@ -0,0 +1,188 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "sample_log.h"
+
+// 动态加载模式下的后台加载线程：第 m 层推理的同时创建后面几层的 handle，
+// 用完的层交给后台线程释放，常驻的 handle 数量不超过 prefetch_num + 1
+// 常驻（不参与动态加载）的层不经过这里，预取时直接跳过
+class LLMLayerPrefetcher
+{
+public:
+    typedef std::function<int(int)> LayerFunc;
+
+private:
+    enum LayerState
+    {
+        LS_UNLOADED,
+        LS_LOADING,
+        LS_LOADED,
+        LS_UNLOADING,
+        LS_FAILED, // 加载失败，handle 无效，Acquire 时报错并恢复为 LS_UNLOADED，下次重新加载
+    };
+
+    struct Task
+    {
+        bool b_load;
+        int layer;
+    };
+
+    int _layer_num = 0;
+    int _prefetch_num = 0;
+    std::vector<bool> _b_streamed;
+    LayerFunc _load_func, _unload_func;
+
+    std::vector<LayerState> _states;
+    std::deque<Task> _tasks;
+    std::mutex _mtx;
+    std::condition_variable _cv_task, _cv_state;
+    std::thread _worker;
+    bool _b_running = false;
+
+    void worker()
+    {
+        while (true)
+        {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(_mtx);
+                _cv_task.wait(lock, [this]
+                              { return !_b_running || !_tasks.empty(); });
+                if (_tasks.empty())
+                {
+                    return;
+                }
+                task = _tasks.front();
+                _tasks.pop_front();
+            }
+
+            int ret = task.b_load ? _load_func(task.layer) : _unload_func(task.layer);
+            if (ret != 0)
+            {
+                ALOGE("%s layer %d failed", task.b_load ? "load" : "unload", task.layer);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(_mtx);
+                if (task.b_load)
+                {
+                    _states[task.layer] = ret == 0 ? LS_LOADED : LS_FAILED;
+                }
+                else
+                {
+                    _states[task.layer] = LS_UNLOADED;
+                }
+            }
+            _cv_state.notify_all();
+        }
+    }
+
+    // 调用时需持有 _mtx
+    void request_load(int m)
+    {
+        if (_states[m] == LS_UNLOADED)
+        {
+            _states[m] = LS_LOADING;
+            _tasks.push_back({true, m});
+            _cv_task.notify_one();
+        }
+    }
+
+public:
+    ~LLMLayerPrefetcher()
+    {
+        Deinit();
+    }
+
+    void Init(const std::vector<bool> &b_streamed, int prefetch_num, LayerFunc load_func, LayerFunc unload_func)
+    {
+        Deinit();
+        _layer_num = b_streamed.size();
+        _b_streamed = b_streamed;
+        int streamed_num = std::count(b_streamed.begin(), b_streamed.end(), true);
+        _prefetch_num = std::max(0, std::min(prefetch_num, streamed_num - 1));
+        _states.assign(_layer_num, LS_UNLOADED);
+        _load_func = load_func;
+        _unload_func = unload_func;
+        _tasks.clear();
+        _b_running = true;
+        _worker = std::thread(&LLMLayerPrefetcher::worker, this);
+    }
+
+    // 处理完剩余任务后退出后台线程，并释放所有仍然常驻的层
+    void Deinit()
+    {
+        if (!_b_running)
+        {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            _b_running = false;
+        }
+        _cv_task.notify_all();
+        _worker.join();
+
+        for (int m = 0; m < _layer_num; m++)
+        {
+            if (_states[m] == LS_LOADED)
+            {
+                _unload_func(m);
+                _states[m] = LS_UNLOADED;
+            }
+        }
+        _prefetch_num = 0;
+    }
+
+    int GetPrefetchNum()
+    {
+        return _prefetch_num;
+    }
+
+    // 等待第 m 层加载完成，同时把后面 prefetch_num 个动态加载的层（循环到下一个 token 的第 0 层）排进加载队列；
+    // 加载失败时返回 -1，handle 不可用
+    int Acquire(int m)
+    {
+        std::unique_lock<std::mutex> lock(_mtx);
+        request_load(m);
+        for (int k = 1, n = 0; k < _layer_num && n < _prefetch_num; k++)
+        {
+            int next = (m + k) % _layer_num;
+            if (_b_streamed[next])
+            {
+                request_load(next);
+                n++;
+            }
+        }
+        while (_states[m] != LS_LOADED)
+        {
+            if (_states[m] == LS_FAILED)
+            {
+                _states[m] = LS_UNLOADED;
+                return -1;
+            }
+            // 第 m 层可能还在排队释放，释放完再重新加载
+            request_load(m);
+            _cv_state.wait(lock);
+        }
+        return 0;
+    }
+
+    // 第 m 层推理结束，交给后台线程释放
+    void Release(int m)
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        if (_states[m] == LS_LOADED)
+        {
+            _states[m] = LS_UNLOADING;
+            _tasks.push_back({false, m});
+            _cv_task.notify_one();
+        }
+    }
+};
@@ -0,0 +1,103 @@
+#pragma once
+#include <vector>
+
+// 会话内的惩罚状态：滑动窗口内每个 token 的出现次数，每生成一个 token O(1) 更新，
+// 采样时按下标直接查表，不再每步从历史重建集合
+class LLMPenaltyTracker
+{
+private:
+    int window = 0; // <= 0 表示整个历史
+
+    std::vector<int> counts;            // 词表大小，窗口内的出现次数
+    std::vector<unsigned char> flags;   // 词表大小，出现次数 > 0 时为 1，采样时顺序扫描比 counts 省带宽
+    std::vector<int> active;            // 出现次数 > 0 的 token，reset 时只清这些位置
+    std::vector<int> active_pos;        // token 在 active 中的位置
+
+    std::vector<int> ring; // 窗口内的 token，循环缓冲
+    int ring_head = 0, ring_size = 0;
+
+    void remove_one(int token)
+    {
+        if (--counts[token] == 0)
+        {
+            flags[token] = 0;
+            int pos = active_pos[token];
+            int last = active.back();
+            active[pos] = last;
+            active_pos[last] = pos;
+            active.pop_back();
+        }
+    }
+
+public:
+    void init(int vocab_size, int window)
+    {
+        this->window = window;
+        counts.assign(vocab_size, 0);
+        flags.assign(vocab_size, 0);
+        active_pos.assign(vocab_size, 0);
+        active.clear();
+        active.reserve(window > 0 ? window : 1024);
+        ring.assign(window > 0 ? window : 0, 0);
+        ring_head = 0;
+        ring_size = 0;
+    }
+
+    void reset()
+    {
+        for (int token : active)
+        {
+            counts[token] = 0;
+            flags[token] = 0;
+        }
+        active.clear();
+        ring_head = 0;
+        ring_size = 0;
+    }
+
+    void push(int token)
+    {
+        if (token < 0 || token >= (int)counts.size())
+        {
+            return;
+        }
+
+        if (window > 0)
+        {
+            if (ring_size == window)
+            {
+                // 窗口已满，ring_head 处是最旧的 token，换成新 token 后 ring_head 后移
+                remove_one(ring[ring_head]);
+                ring[ring_head] = token;
+                ring_head = (ring_head + 1) % window;
+            }
+            else
+            {
+                ring[(ring_head + ring_size) % window] = token;
+                ring_size++;
+            }
+        }
+
+        if (counts[token]++ == 0)
+        {
+            flags[token] = 1;
+            active_pos[token] = active.size();
+            active.push_back(token);
+        }
+    }
+
+    int count(int token) const
+    {
+        return counts[token];
+    }
+
+    const unsigned char *data_flags() const
+    {
+        return flags.data();
+    }
+
+    bool empty() const
+    {
+        return active.empty();
+    }
+};
@@ -1,241 +1,143 @@
 #pragma once
 #include <iostream>
+#include <fstream>
 #include <vector>
 #include <random>
 #include <algorithm>
 #include <numeric>
 #include <cmath>
-#include <unordered_set>
 #include "utils/json.hpp"
+#include "utils/bfloat16.hpp"
 #include "utils/sample_log.h"
+#include "LLMPenaltyTracker.hpp"
 
 class LLMPostprocess
 {
 private:
-    // 	控制随机性
-    void apply_temperature(std::vector<float> &logits, float temperature)
+    // 按权重采样，权重不需要归一化，代替 std::discrete_distribution（每次构造都会分配内存）
+    int sample_index(const float *weights, int n)
     {
-        for (float &logit : logits)
+        float sum = std::accumulate(weights, weights + n, 0.0f);
+        float r = std::uniform_real_distribution<float>(0.0f, sum)(rng);
+        for (int i = 0; i < n; ++i)
         {
-            logit /= temperature;
+            r -= weights[i];
+            if (r < 0)
+                return i;
         }
+        return n - 1;
     }
 
-    // 防止重复
-    void apply_repetition_penalty(std::vector<float> &logits, const std::vector<int> &history, float penalty)
+    enum
     {
-        for (int token : history)
-        {
-            if (token < logits.size())
-            {
-                logits[token] = logits[token] < 0 ? logits[token] * penalty : logits[token] / penalty;
-            }
-        }
-    }
+        PENALTY_DIVERSITY = 1,
+    };
 
-    void apply_repetition_penalty(std::vector<float> &logits,
-                                  const std::vector<int> &generated_tokens,
-                                  float repetition_penalty,
-                                  int penalty_window)
+    // common_phrases 不随 token 变化，标记常驻在 token_marks 中，只在设置或词表大小变化时重建
+    void update_diversity_marks()
     {
-        if (repetition_penalty == 1.0f || generated_tokens.empty())
+        for (auto &mark : token_marks)
         {
-            return; // 如果 penalty = 1.0 或者没有生成 token，则不进行修改
+            mark &= ~PENALTY_DIVERSITY;
         }
-
-        int start_idx = std::max(0, (int)generated_tokens.size() - penalty_window);
-        std::unordered_set<int> recent_tokens(generated_tokens.begin() + start_idx, generated_tokens.end());
-
-        for (int token : recent_tokens)
-        {
-            if (token < 0 || token >= logits.size())
-                continue;
-
-            if (logits[token] > 0)
-            {
-                logits[token] /= std::sqrt(repetition_penalty);
-            }
-            else
-            {
-                logits[token] *= std::sqrt(repetition_penalty);
-            }
-        }
-    }
-
-    // 增强多样性
-    void apply_diversity_penalty(std::vector<float> &logits, const std::vector<int> &common_phrases, float penalty)
-    {
         for (int token : common_phrases)
         {
-            if (token < logits.size())
-            {
-                logits[token] *= penalty;
-            }
+            if (token >= 0 && token < token_marks.size())
+                token_marks[token] |= PENALTY_DIVERSITY;
         }
     }
 
-    // Softmax function
-    std::vector<float> softmax(const std::vector<float> &logits)
-    {
-        std::vector<float> probs(logits.size());
-        float max_logit = *std::max_element(logits.begin(), logits.end());
-        float sum = 0.0f;
+    bool enable_temperature = false;
+    float temperature = 1.0f;
 
-        for (size_t i = 0; i < logits.size(); ++i)
-        {
-            probs[i] = std::exp(logits[i] - max_logit);
-            sum += probs[i];
-        }
+    bool enable_repetition_penalty = false;
+    float repetition_penalty = 1.0f;
+    int penalty_window = 20;
 
-        for (float &p : probs)
-        {
-            p /= sum;
-        }
+    bool enable_diversity_penalty = false;
+    std::vector<int> common_phrases;
+    float diversity_penalty = 1.0f;
 
-        return probs;
-    }
+    // OpenAI 风格：logit -= count * frequency_penalty + (count > 0) * presence_penalty，0 表示不启用
+    float frequency_penalty = 0.0f;
+    float presence_penalty = 0.0f;
 
-    // 	动态裁剪低概率 token
-    int faster_top_p_sampling(const std::vector<float> &logits, float top_p)
-    {
-        // 计算softmax
-        std::vector<float> probs = softmax(logits);
+    // 本次生成的 token 在 penalty_window 内的计数，penalty_window <= 0 时统计整个历史
+    LLMPenaltyTracker penalty_tracker;
+    int vocab_size = 0;
 
-        // 构建最大堆（概率和索引的配对）
-        std::vector<std::pair<float, size_t>> prob_index;
-        prob_index.reserve(logits.size());
-        for (size_t i = 0; i < logits.size(); ++i)
-        {
-            prob_index.emplace_back(probs[i], i);
-        }
-        auto cmp = [](const auto &a, const auto &b)
-        { return a.first < b.first; };
-        std::make_heap(prob_index.begin(), prob_index.end(), cmp);
+    bool enable_top_p_sampling = false;
+    float top_p = 1.0f;
+    int top_p_max_candidates = 1024; // 融合流程中 top-p 最多保留的候选数
 
-        // 提取top-p元素
-        std::vector<size_t> filtered_indices;
-        std::vector<float> filtered_probs;
-        float cumulative_prob = 0.0f;
+    bool enable_top_k_sampling = false;
+    int top_k = 1;
 
-        while (!prob_index.empty() && cumulative_prob < top_p)
-        {
-            std::pop_heap(prob_index.begin(), prob_index.end(), cmp);
-            auto [prob, index] = prob_index.back();
-            prob_index.pop_back();
+    // 采样用的工作区，按候选数分配一次后每个 token 复用，不再逐 token 分配
+    std::vector<std::pair<int, float>> candidates_buf;
+    std::vector<float> filtered_probs_buf;
+    std::vector<unsigned char> token_marks;
 
-            cumulative_prob += prob;
-            filtered_indices.push_back(index);
-            filtered_probs.push_back(prob);
+    // 随机数生成器按会话重新播种，seed < 0 时每个会话使用随机种子
+    long long seed = -1;
+    std::mt19937 rng{std::random_device{}()};
 
-            if (cumulative_prob >= top_p)
-                break;
-        }
+public:
+    LLMPostprocess() {}
 
-        // 处理边缘情况（概率全零时返回第一个元素）
-        if (filtered_indices.empty())
-            return 0;
+    // 预分配工作区，之后每个 token 的采样都不会再分配内存
+    void reserve(int vocab_size)
+    {
+        this->vocab_size = vocab_size;
+        penalty_tracker.init(vocab_size, penalty_window);
+        reserve_candidates();
+        token_marks.resize(vocab_size, 0);
+        update_diversity_marks();
+    }
 
-        // 使用thread_local随机数生成器（线程安全）
-        static thread_local std::mt19937 gen(std::random_device{}());
-        std::discrete_distribution<int> dist(filtered_probs.begin(), filtered_probs.end());
-        return filtered_indices[dist(gen)];
+    // 只取最大值时 temperature 不影响结果，可以跳过 logits 的转换直接求 argmax
+    bool is_greedy()
+    {
+        return !enable_top_p_sampling && !enable_top_k_sampling && !has_token_penalty() && !enable_diversity_penalty;
     }
-    int top_p_sampling(const std::vector<float> &logits, float top_p)
+
+    // 依赖已生成 token 的惩罚是否启用
+    bool has_token_penalty()
     {
-        std::vector<float> probs = softmax(logits);
-
-        // Sort indices by probability in descending order
-        std::vector<size_t> indices(logits.size());
-        std::iota(indices.begin(), indices.end(), 0);
-        std::sort(indices.begin(), indices.end(), [&](size_t i, size_t j)
-                  { return probs[i] > probs[j]; });
-
-        // Compute cumulative probabilities
-        float cumulative_prob = 0.0f;
-        size_t cut_off = 0;
-        for (; cut_off < indices.size(); ++cut_off)
-        {
-            cumulative_prob += probs[indices[cut_off]];
-            if (cumulative_prob >= top_p)
-                break;
-        }
+        return (enable_repetition_penalty && repetition_penalty != 1.0f) || frequency_penalty != 0.0f || presence_penalty != 0.0f;
+    }
 
-        // Keep only the top-p probabilities
-        std::vector<size_t> filtered_indices(indices.begin(), indices.begin() + cut_off + 1);
-        std::vector<float> filtered_probs(filtered_indices.size());
-        for (size_t i = 0; i < filtered_indices.size(); ++i)
-        {
-            filtered_probs[i] = probs[filtered_indices[i]];
-        }
+    // 开始一次新的生成时清空惩罚计数
+    void reset_penalty()
+    {
+        penalty_tracker.reset();
+    }
 
-        // Normalize the probabilities
-        float filtered_sum = std::accumulate(filtered_probs.begin(), filtered_probs.end(), 0.0f);
-        for (float &p : filtered_probs)
-        {
-            p /= filtered_sum;
-        }
+    // 每生成一个 token 调用一次，O(1) 更新惩罚计数
+    void accept_token(int token)
+    {
+        penalty_tracker.push(token);
+    }
 
-        // Sample from the filtered distribution
-        std::random_device rd;
-        std::mt19937 gen(rd());
-        std::discrete_distribution<int> dist(filtered_probs.begin(), filtered_probs.end());
-        return filtered_indices[dist(gen)];
+    void set_seed(long long seed)
+    {
+        this->seed = seed;
+        reset_session();
     }
 
-    // 限制候选 token 数
-    int top_k_sampling(const std::vector<float> &logits, int k)
+    // 新会话开始时调用，固定 seed 时同样的输入得到同样的输出
+    void reset_session()
     {
-        // std::vector<float> probs = softmax(logits);
-
-        // 获取 top-k 索引
-        std::vector<size_t> indices(logits.size());
-        std::iota(indices.begin(), indices.end(), 0);
-        std::partial_sort(indices.begin(), indices.begin() + k, indices.end(), [&](size_t i, size_t j)
-                          { return logits[i] > logits[j]; });
-
-        // 仅保留 top-k 概率
-        std::vector<size_t> filtered_indices(indices.begin(), indices.begin() + k);
-        std::vector<float> filtered_probs(k);
-        for (size_t i = 0; i < k; ++i)
+        if (seed >= 0)
         {
-            filtered_probs[i] = logits[filtered_indices[i]];
+            rng.seed((std::mt19937::result_type)seed);
         }
-        filtered_probs = softmax(filtered_probs);
-
-        // 归一化
-        float sum = std::accumulate(filtered_probs.begin(), filtered_probs.end(), 0.0f);
-        for (float &p : filtered_probs)
+        else
         {
-            p /= sum;
+            rng.seed(std::random_device{}());
         }
-
-        // 采样
-        std::random_device rd;
-        std::mt19937 gen(rd());
-        std::discrete_distribution<int> dist(filtered_probs.begin(), filtered_probs.end());
-        return filtered_indices[dist(gen)];
     }
 
-    bool enable_temperature = false;
-    float temperature = 1.0f;
-
-    bool enable_repetition_penalty = false;
-    float repetition_penalty = 1.0f;
-    int penalty_window = 20;
-
-    bool enable_diversity_penalty = false;
-    std::vector<int> common_phrases;
-    float diversity_penalty = 1.0f;
-
-    bool enable_top_p_sampling = false;
-    float top_p = 1.0f;
-
-    bool enable_top_k_sampling = false;
-    int top_k = 1;
-
-public:
-    LLMPostprocess() {}
-
     void set_temperature(bool enable, float temperature)
     {
         enable_temperature = enable;
@@ -253,6 +155,17 @@ public:
         enable_diversity_penalty = enable;
         this->common_phrases = common_phrases;
         this->diversity_penalty = penalty;
+        update_diversity_marks();
+    }
+
+    void set_frequency_penalty(float penalty)
+    {
+        frequency_penalty = penalty;
+    }
+
+    void set_presence_penalty(float penalty)
+    {
+        presence_penalty = penalty;
     }
 
     void set_top_p_sampling(bool enable, float top_p)
@@ -267,6 +180,10 @@ public:
         enable_top_p_sampling = false;
         enable_top_k_sampling = enable;
         this->top_k = top_k;
+        if (vocab_size > 0)
+        {
+            reserve_candidates();
+        }
     }
 
     bool load_config(std::string config_path)
@@ -279,41 +196,219 @@ public:
         }
         nlohmann::json config = nlohmann::json::parse(config_file);
         ALOGI("load config: \n%s\n", config.dump(4).c_str());
+        apply_config(config);
+        return true;
+    }
 
+    // 按 json 配置设置采样参数，格式与 post_config.json 相同，可用于按请求覆盖参数
+    void apply_config(nlohmann::json config)
+    {
         enable_temperature = config["enable_temperature"];
         temperature = config["temperature"];
 
         enable_repetition_penalty = config["enable_repetition_penalty"];
         repetition_penalty = config["repetition_penalty"];
         penalty_window = config["penalty_window"];
+        if (config.contains("frequency_penalty"))
+        {
+            frequency_penalty = config["frequency_penalty"];
+        }
+        if (config.contains("presence_penalty"))
+        {
+            presence_penalty = config["presence_penalty"];
+        }
+        if (vocab_size > 0)
+        {
+            penalty_tracker.init(vocab_size, penalty_window);
+        }
 
         enable_top_p_sampling = config["enable_top_p_sampling"];
         top_p = config["top_p"];
+        if (config.contains("top_p_max_candidates"))
+        {
+            top_p_max_candidates = std::max(1, (int)config["top_p_max_candidates"]);
+        }
 
         enable_top_k_sampling = config["enable_top_k_sampling"];
         top_k = config["top_k"];
-        return true;
+
+        if (config.contains("seed"))
+        {
+            seed = config["seed"];
+        }
+        reset_session();
+
+        // top_k/top_p_max_candidates 变大时在这里扩容，采样时不再分配
+        if (vocab_size > 0)
+        {
+            reserve_candidates();
+        }
     }
 
-    int apply(std::vector<float> &logits, const std::vector<int> &history)
+    // 单次遍历 bf16 logits：边转换边施加惩罚和 temperature，惩罚按 penalty_tracker 的计数查表，
+    // 用大小为 K 的小顶堆保留候选，只在候选上归一化和采样。
+    // top-p 需要全词表的归一化因子，同一遍里用在线 logsumexp 累计，候选数超过 top_p_max_candidates 时截断
+    int apply(const unsigned short *logits, int n)
     {
-        if (enable_temperature)
-            apply_temperature(logits, temperature);
-        if (enable_repetition_penalty)
-            apply_repetition_penalty(logits, history, repetition_penalty, penalty_window);
-        if (enable_diversity_penalty)
-            apply_diversity_penalty(logits, common_phrases, diversity_penalty);
-
+        int k = 1;
         if (enable_top_p_sampling)
-            return faster_top_p_sampling(logits, top_p);
+            k = top_p_max_candidates;
         else if (enable_top_k_sampling)
-            return top_k_sampling(logits, top_k);
+            k = top_k;
+        k = std::max(1, std::min(k, n));
+
+        if (vocab_size < n)
+        {
+            reserve(n);
+        }
+        bool b_token_penalty = has_token_penalty() && !penalty_tracker.empty();
+        bool b_repetition = enable_repetition_penalty && repetition_penalty != 1.0f;
+        const unsigned char *p_counted = penalty_tracker.data_flags();
+        float sqrt_penalty = std::sqrt(repetition_penalty);
+        float scale = enable_temperature ? 1.0f / temperature : 1.0f;
+        float run_max = -INFINITY, run_sum = 0.0f;
+
+        std::vector<std::pair<int, float>> &candidates = candidates_buf;
+        candidates.clear();
+        auto cmp = [](const std::pair<int, float> &a, const std::pair<int, float> &b)
+        {
+            return a.second > b.second || (a.second == b.second && a.first < b.first);
+        };
+
+        const int block = 256;
+        float vals[block];
+        for (int base = 0; base < n; base += block)
+        {
+            int len = std::min(block, n - base);
+            bfloat16_to_float(logits + base, vals, len);
+            for (int j = 0; j < len; j++)
+            {
+                int idx = base + j;
+                float v = vals[j];
+                if (b_token_penalty && p_counted[idx])
+                {
+                    if (b_repetition)
+                        v = v > 0 ? v / sqrt_penalty : v * sqrt_penalty;
+                    v -= penalty_tracker.count(idx) * frequency_penalty + presence_penalty;
+                }
+                if (enable_diversity_penalty && (token_marks[idx] & PENALTY_DIVERSITY))
+                    v *= diversity_penalty;
+                v *= scale;
+
+                if (enable_top_p_sampling)
+                {
+                    if (v > run_max)
+                    {
+                        run_sum = run_sum * std::exp(run_max - v) + 1.0f;
+                        run_max = v;
+                    }
+                    else if (v > -INFINITY)
+                    {
+                        run_sum += std::exp(v - run_max);
+                    }
+                }
+
+                if ((int)candidates.size() < k)
+                {
+                    candidates.emplace_back(idx, v);
+                    std::push_heap(candidates.begin(), candidates.end(), cmp);
+                }
+                else if (v > candidates.front().second)
+                {
+                    std::pop_heap(candidates.begin(), candidates.end(), cmp);
+                    candidates.back() = std::make_pair(idx, v);
+                    std::push_heap(candidates.begin(), candidates.end(), cmp);
+                }
+            }
+        }
+        std::sort_heap(candidates.begin(), candidates.end(), cmp);
+
+        return sample_sorted_candidates(candidates, run_max, run_sum);
+    }
+
+    // 只有 K 个候选（例如 post 模型在 NPU 上做了 top-k）时，惩罚、temperature 和采样都只在候选上进行。
+    // top-p 的概率只能在这 K 个候选内归一化，K 足够大时与全词表的结果基本一致
+    int apply(std::vector<std::pair<int, float>> &candidates)
+    {
+        if (candidates.empty())
+            return 0;
+
+        bool b_token_penalty = has_token_penalty() && !penalty_tracker.empty();
+        bool b_repetition = enable_repetition_penalty && repetition_penalty != 1.0f;
+        float sqrt_penalty = std::sqrt(repetition_penalty);
+        float scale = enable_temperature ? 1.0f / temperature : 1.0f;
+        for (auto &candidate : candidates)
+        {
+            int idx = candidate.first;
+            float v = candidate.second;
+            if (idx >= 0 && idx < vocab_size)
+            {
+                if (b_token_penalty && penalty_tracker.count(idx))
+                {
+                    if (b_repetition)
+                        v = v > 0 ? v / sqrt_penalty : v * sqrt_penalty;
+                    v -= penalty_tracker.count(idx) * frequency_penalty + presence_penalty;
+                }
+                if (enable_diversity_penalty && (token_marks[idx] & PENALTY_DIVERSITY))
+                    v *= diversity_penalty;
+            }
+            candidate.second = v * scale;
+        }
+        std::sort(candidates.begin(), candidates.end(), [](const std::pair<int, float> &a, const std::pair<int, float> &b)
+                  { return a.second > b.second || (a.second == b.second && a.first < b.first); });
+        if (enable_top_k_sampling && !enable_top_p_sampling && top_k < candidates.size())
+        {
+            candidates.resize(std::max(1, top_k));
+        }
+
+        float run_max = candidates[0].second, run_sum = 0.0f;
+        for (auto &candidate : candidates)
+        {
+            run_sum += std::exp(candidate.second - run_max);
+        }
+        return sample_sorted_candidates(candidates, run_max, run_sum);
+    }
+
+private:
+    // 候选数不会超过词表大小，请求中过大的 top_k 不会分配多余的内存
+    void reserve_candidates()
+    {
+        int num = std::max(1, std::max(top_k, top_p_max_candidates));
+        if (vocab_size > 0)
+        {
+            num = std::min(num, vocab_size);
+        }
+        candidates_buf.reserve(num);
+        filtered_probs_buf.reserve(num);
+    }
+
+    // candidates 已按 logit 从大到小排列，top-p 时 exp(logit - run_max) / run_sum 是候选的概率
+    int sample_sorted_candidates(const std::vector<std::pair<int, float>> &candidates, float run_max, float run_sum)
+    {
+        if (!enable_top_p_sampling && !enable_top_k_sampling)
+            return candidates[0].first;
+
+        std::vector<float> &weights = filtered_probs_buf;
+        weights.clear();
+        if (enable_top_p_sampling)
+        {
+            float cumulative_prob = 0.0f;
+            for (auto &candidate : candidates)
+            {
+                float prob = std::exp(candidate.second - run_max) / run_sum;
+                weights.push_back(prob);
+                cumulative_prob += prob;
+                if (cumulative_prob >= top_p)
+                    break;
+            }
+        }
         else
         {
-            // 最大值
-            float max_logit = *std::max_element(logits.begin(), logits.end());
-            int max_index = std::distance(logits.begin(), std::max_element(logits.begin(), logits.end()));
-            return max_index;
+            for (auto &candidate : candidates)
+            {
+                weights.push_back(std::exp(candidate.second - candidates[0].second));
+            }
         }
+        return candidates[sample_index(weights.data(), weights.size())].first;
     }
 };
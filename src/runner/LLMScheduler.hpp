@@ -0,0 +1,398 @@
+#pragma once
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "LLM.hpp"
+
+// 优先级数值越小越优先，高优先级的请求到达时正在运行的低优先级请求在下一个 token 处被抢占
+enum LLMPriority
+{
+    LLM_PRIORITY_INTERACTIVE = 0,
+    LLM_PRIORITY_NORMAL,
+    LLM_PRIORITY_BATCH,
+    LLM_PRIORITY_END
+};
+
+enum LLMRequestStatus
+{
+    LLM_REQUEST_PENDING,
+    LLM_REQUEST_DONE,
+    LLM_REQUEST_TIMEOUT,   // 超过 deadline，text 中是已经生成的部分
+    LLM_REQUEST_CANCELLED, // 调用方取消，text 中是已经生成的部分
+    LLM_REQUEST_FAILED,
+};
+
+struct LLMRequest
+{
+    std::string prompt; // 已经套好对话模板的 prompt
+    int priority = LLM_PRIORITY_NORMAL;
+    int max_new_tokens = -1;
+    // 超过 deadline 的请求不再开始，正在运行的在下一个 token 处结束
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    // 开始运行前在推理线程中调用，用来设置采样参数；抢占后恢复时沿用保存的采样状态，不再调用
+    std::function<void(LLM &)> setup;
+    // 在推理线程中调用，参数与 LLMRuningCallback 相同
+    std::function<void(int *p_token, int n_token, const char *p_str, float token_per_sec)> callback;
+};
+
+struct LLMResult
+{
+    LLMRequestStatus status = LLM_REQUEST_PENDING;
+    std::string text;
+    LLMRunStats stats; // 多次抢占恢复时累计 completion_tokens，prompt_tokens 为第一次运行的输入
+};
+
+// 提交后得到的句柄，用于等待结果和取消
+class LLMTicket
+{
+    friend class LLMScheduler;
+
+    LLMRequest request;
+    LLMResult result;
+    long long seq = 0;
+    bool b_cancel = false;
+    bool b_preempt = false;
+    LLMSession session; // 被抢占时保存的会话
+    bool b_session_saved = false;
+    std::vector<int> output_ids;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+
+public:
+    // 等待请求结束
+    const LLMResult &Wait()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [this]
+                { return result.status != LLM_REQUEST_PENDING; });
+        return result;
+    }
+
+    bool IsDone()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return result.status != LLM_REQUEST_PENDING;
+    }
+};
+
+// LLM 前面的请求调度：
+// - 有界排队，队列满时 Submit 返回 nullptr，由调用方拒绝请求
+// - 按优先级、同优先级按 deadline 和提交顺序选择下一个请求
+// - 高优先级请求到达时打断正在运行的低优先级请求，把它的 KV 行和采样状态保存到 host 内存，稍后从打断处继续
+// 所有推理都在调度器的线程中进行，LLM 不需要是线程安全的
+class LLMScheduler
+{
+private:
+    typedef std::chrono::steady_clock clock;
+
+    LLM &llm;
+    int max_queue_size;
+
+    std::vector<std::shared_ptr<LLMTicket>> queue; // 等待中的请求，包括被抢占的
+    std::shared_ptr<LLMTicket> running;
+    long long next_seq = 0;
+    bool b_running = false;
+
+    std::mutex mtx;
+    std::condition_variable cv_queue, cv_monitor;
+    std::thread worker_thread, monitor_thread;
+
+    static void on_token(int *p_token, int n_token, const char *p_str, float token_per_sec, void *reserve)
+    {
+        auto ticket = (LLMTicket *)reserve;
+        if (ticket->request.callback)
+        {
+            ticket->request.callback(p_token, n_token, p_str, token_per_sec);
+        }
+    }
+
+    // 调用时需持有 mtx
+    bool should_stop(const std::shared_ptr<LLMTicket> &ticket)
+    {
+        return ticket->b_cancel || ticket->b_preempt || clock::now() >= ticket->request.deadline;
+    }
+
+    // 调用时需持有 mtx，队列为空时返回 nullptr
+    std::shared_ptr<LLMTicket> pop_next()
+    {
+        auto best = queue.end();
+        for (auto it = queue.begin(); it != queue.end(); ++it)
+        {
+            if (best == queue.end() || better((*it)->request, (*it)->seq, (*best)->request, (*best)->seq))
+            {
+                best = it;
+            }
+        }
+        if (best == queue.end())
+        {
+            return nullptr;
+        }
+        auto ticket = *best;
+        queue.erase(best);
+        return ticket;
+    }
+
+    static bool better(const LLMRequest &a, long long seq_a, const LLMRequest &b, long long seq_b)
+    {
+        if (a.priority != b.priority)
+        {
+            return a.priority < b.priority;
+        }
+        if (a.deadline != b.deadline)
+        {
+            return a.deadline < b.deadline;
+        }
+        return seq_a < seq_b;
+    }
+
+    void finish(const std::shared_ptr<LLMTicket> &ticket, LLMRequestStatus status)
+    {
+        ticket->session = LLMSession();
+        {
+            std::lock_guard<std::mutex> lock(ticket->mtx);
+            ticket->result.stats.completion_tokens = ticket->output_ids.size();
+            ticket->result.stats.output_ids = ticket->output_ids;
+            ticket->result.text = ticket->output_ids.empty() ? "" : llm.Decode(ticket->output_ids);
+            ticket->result.status = status;
+        }
+        ticket->cv.notify_all();
+    }
+
+    // 运行一段，直到完成或被打断
+    void run_segment(const std::shared_ptr<LLMTicket> &ticket)
+    {
+        auto &request = ticket->request;
+        auto attr = llm.getAttr();
+        attr->runing_callback = on_token;
+        attr->reserve = ticket.get();
+        attr->max_new_tokens = request.max_new_tokens > 0 ? std::max(1, request.max_new_tokens - (int)ticket->output_ids.size()) : -1;
+
+        if (ticket->b_session_saved)
+        {
+            llm.RunResume(ticket->session);
+        }
+        else
+        {
+            if (request.setup)
+            {
+                request.setup(llm);
+            }
+            llm.Run(request.prompt);
+        }
+        attr->runing_callback = nullptr;
+        attr->reserve = nullptr;
+
+        auto &stats = llm.GetRunStats();
+        if (!ticket->b_session_saved)
+        {
+            ticket->result.stats.prompt_tokens = stats.prompt_tokens;
+            ticket->result.stats.ttft_ms = stats.ttft_ms;
+        }
+        ticket->output_ids.insert(ticket->output_ids.end(), stats.output_ids.begin(), stats.output_ids.end());
+        ticket->result.stats.b_hit_eos = stats.b_hit_eos;
+        ticket->result.stats.token_per_sec = stats.token_per_sec;
+    }
+
+    void worker()
+    {
+        while (true)
+        {
+            std::shared_ptr<LLMTicket> ticket;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv_queue.wait(lock, [this]
+                              { return !b_running || !queue.empty(); });
+                if (!b_running)
+                {
+                    break;
+                }
+                ticket = pop_next();
+                if (ticket->b_cancel || clock::now() >= ticket->request.deadline)
+                {
+                    lock.unlock();
+                    finish(ticket, ticket->b_cancel ? LLM_REQUEST_CANCELLED : LLM_REQUEST_TIMEOUT);
+                    continue;
+                }
+                ticket->b_preempt = false;
+                running = ticket;
+            }
+            cv_monitor.notify_all();
+
+            run_segment(ticket);
+
+            bool b_preempt, b_cancel, b_timeout;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                running = nullptr;
+                b_preempt = ticket->b_preempt;
+                b_cancel = ticket->b_cancel;
+                b_timeout = clock::now() >= ticket->request.deadline;
+            }
+
+            auto &stats = llm.GetRunStats();
+            bool b_finished = stats.b_hit_eos ||
+                              (ticket->request.max_new_tokens > 0 && (int)ticket->output_ids.size() >= ticket->request.max_new_tokens);
+            if (b_cancel)
+            {
+                finish(ticket, LLM_REQUEST_CANCELLED);
+            }
+            else if (b_timeout && !b_finished)
+            {
+                finish(ticket, LLM_REQUEST_TIMEOUT);
+            }
+            else if (b_preempt && !b_finished)
+            {
+                // 这一段还没生成 token 时没有新的状态可保存：恢复过的沿用之前保存的会话，否则之后从头运行
+                ticket->b_session_saved = llm.SaveSession(ticket->session) || ticket->b_session_saved;
+                ALOGI("request %lld preempted after %d tokens", ticket->seq, (int)ticket->output_ids.size());
+                std::unique_lock<std::mutex> lock(mtx);
+                if (b_running)
+                {
+                    queue.push_back(ticket);
+                }
+                else
+                {
+                    // Stop 在这一段结束后、放回队列前已经取走了队列，不再放回，否则没有人结束它
+                    lock.unlock();
+                    finish(ticket, LLM_REQUEST_CANCELLED);
+                }
+            }
+            else if (stats.prompt_tokens == 0 && ticket->output_ids.empty())
+            {
+                finish(ticket, LLM_REQUEST_FAILED);
+            }
+            else
+            {
+                finish(ticket, LLM_REQUEST_DONE);
+            }
+        }
+    }
+
+    // Stop 只在推理循环中检查，运行中的请求需要打断时反复调用，避免打断发生在 Run 清除标志之前而被忽略
+    void monitor()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (b_running)
+        {
+            auto wait_until = clock::now() + std::chrono::milliseconds(100);
+            if (running)
+            {
+                if (should_stop(running))
+                {
+                    llm.Stop();
+                    wait_until = clock::now() + std::chrono::milliseconds(5);
+                }
+                else
+                {
+                    wait_until = std::min(wait_until, running->request.deadline);
+                }
+            }
+            cv_monitor.wait_until(lock, wait_until);
+        }
+    }
+
+public:
+    LLMScheduler(LLM &llm, int max_queue_size = 16) : llm(llm), max_queue_size(max_queue_size) {}
+
+    ~LLMScheduler()
+    {
+        Stop();
+    }
+
+    void Start()
+    {
+        if (b_running)
+        {
+            return;
+        }
+        b_running = true;
+        worker_thread = std::thread(&LLMScheduler::worker, this);
+        monitor_thread = std::thread(&LLMScheduler::monitor, this);
+    }
+
+    // 打断正在运行的请求并退出，排队中的请求以 LLM_REQUEST_CANCELLED 结束
+    void Stop()
+    {
+        std::vector<std::shared_ptr<LLMTicket>> pending;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (!b_running)
+            {
+                return;
+            }
+            b_running = false;
+            if (running)
+            {
+                running->b_cancel = true;
+                llm.Stop();
+            }
+            pending.swap(queue);
+        }
+        cv_queue.notify_all();
+        cv_monitor.notify_all();
+        worker_thread.join();
+        monitor_thread.join();
+        for (auto &ticket : pending)
+        {
+            finish(ticket, LLM_REQUEST_CANCELLED);
+        }
+    }
+
+    // 提交请求，队列已满时返回 nullptr；比正在运行的请求优先级高时打断它
+    std::shared_ptr<LLMTicket> Submit(const LLMRequest &request)
+    {
+        auto ticket = std::make_shared<LLMTicket>();
+        ticket->request = request;
+        ticket->request.priority = std::max(0, std::min((int)LLM_PRIORITY_END - 1, request.priority));
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (!b_running || (int)queue.size() >= max_queue_size)
+            {
+                return nullptr;
+            }
+            ticket->seq = next_seq++;
+            queue.push_back(ticket);
+            if (running && ticket->request.priority < running->request.priority)
+            {
+                running->b_preempt = true;
+            }
+        }
+        cv_queue.notify_one();
+        cv_monitor.notify_all();
+        return ticket;
+    }
+
+    // 取消请求：排队中还没运行过的直接结束，运行中的在下一个 token 处结束
+    void Cancel(const std::shared_ptr<LLMTicket> &ticket)
+    {
+        bool b_removed = false;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            ticket->b_cancel = true;
+            auto it = std::find(queue.begin(), queue.end(), ticket);
+            // 运行过的需要 detokenize 已生成的部分，留给推理线程处理
+            if (it != queue.end() && ticket->output_ids.empty())
+            {
+                queue.erase(it);
+                b_removed = true;
+            }
+        }
+        if (b_removed)
+        {
+            finish(ticket, LLM_REQUEST_CANCELLED);
+        }
+        cv_monitor.notify_all();
+    }
+
+    int GetQueueSize()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return queue.size();
+    }
+};
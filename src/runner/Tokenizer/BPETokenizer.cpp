@@ -0,0 +1,587 @@
+#include "BPETokenizer.hpp"
+
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+
+#include "json.hpp"
+#include "sample_log.h"
+#include "unicode_category.h"
+#include "bpe_merge.h"
+
+using namespace unicode_category;
+
+// GPT-2 的 bytes_to_unicode：可见字符映射到自身，其余字节依次映射到 256 之后，vocab 和 merges 中的字符串都经过这一映射
+static std::vector<uint32_t> bytes_to_unicode()
+{
+    std::vector<uint32_t> table(256);
+    int n = 0;
+    for (int b = 0; b < 256; b++)
+    {
+        bool b_visible = (b >= '!' && b <= '~') || (b >= 0xA1 && b <= 0xAC) || (b >= 0xAE && b <= 0xFF);
+        table[b] = b_visible ? b : 256 + n++;
+    }
+    return table;
+}
+
+// 把 byte-level 字符串还原为原始字节，包含映射之外的字符时返回 false
+static bool byte_level_to_bytes(const std::string &s, const std::vector<int> &unicode_to_byte, std::string &out)
+{
+    out.clear();
+    for (size_t pos = 0; pos < s.size();)
+    {
+        size_t len;
+        uint32_t cp = utf8_decode(s, pos, len);
+        if (cp >= unicode_to_byte.size() || unicode_to_byte[cp] < 0)
+        {
+            return false;
+        }
+        out += (char)unicode_to_byte[cp];
+        pos += len;
+    }
+    return true;
+}
+
+static std::string read_token_content(const nlohmann::json &j)
+{
+    if (j.is_string())
+    {
+        return j;
+    }
+    if (j.is_object() && j.contains("content") && j["content"].is_string())
+    {
+        return j["content"];
+    }
+    return "";
+}
+
+static bool read_json(const std::string &path, nlohmann::json &j)
+{
+    std::ifstream file(path);
+    if (!file.is_open())
+    {
+        return false;
+    }
+    try
+    {
+        j = nlohmann::json::parse(file);
+    }
+    catch (const std::exception &e)
+    {
+        ALOGE("parse %s failed: %s", path.c_str(), e.what());
+        return false;
+    }
+    return true;
+}
+
+bool BPETokenizer::load(const std::string &tokenizer_json_path)
+{
+    nlohmann::json j;
+    if (!read_json(tokenizer_json_path, j))
+    {
+        ALOGE("read tokenizer(%s) failed", tokenizer_json_path.c_str());
+        return false;
+    }
+
+    auto &model = j["model"];
+    if (model.value("type", "") != "BPE" || !model.contains("vocab") || !model.contains("merges"))
+    {
+        ALOGE("only BPE model is supported");
+        return false;
+    }
+    if (j.contains("decoder") && !j["decoder"].is_null() && j["decoder"].value("type", "") != "ByteLevel")
+    {
+        ALOGE("only ByteLevel decoder is supported, got %s", j["decoder"].value("type", "").c_str());
+        return false;
+    }
+    if (j.contains("normalizer") && !j["normalizer"].is_null())
+    {
+        ALOGW("normalizer(%s) is not supported, ignored", j["normalizer"].value("type", "").c_str());
+    }
+
+    // pre_tokenizer
+    std::vector<nlohmann::json> pre_tokenizers;
+    auto &pre_tokenizer = j["pre_tokenizer"];
+    if (pre_tokenizer.value("type", "") == "Sequence")
+    {
+        for (auto &p : pre_tokenizer["pretokenizers"])
+        {
+            pre_tokenizers.push_back(p);
+        }
+    }
+    else if (!pre_tokenizer.is_null())
+    {
+        pre_tokenizers.push_back(pre_tokenizer);
+    }
+    bool b_byte_level = false, b_split = false;
+    for (auto &p : pre_tokenizers)
+    {
+        std::string type = p.value("type", "");
+        if (type == "ByteLevel")
+        {
+            b_byte_level = true;
+            add_prefix_space = p.value("add_prefix_space", false);
+            if (!b_split && p.value("use_regex", true))
+            {
+                style = PRETOKENIZE_GPT2;
+                max_digits = 0;
+            }
+        }
+        else if (type == "Split" && p.contains("pattern") && p["pattern"].contains("Regex"))
+        {
+            b_split = true;
+            std::string pattern = p["pattern"]["Regex"];
+            if (pattern.find("\\s+(?!\\S)") == std::string::npos)
+            {
+                ALOGW("unrecognized pre_tokenizer pattern %s, use cl100k rules", pattern.c_str());
+            }
+            style = pattern.find("[^\\r\\n\\p{L}\\p{N}]?\\p{L}+") == std::string::npos && pattern.find(" ?\\p{L}+") != std::string::npos
+                        ? PRETOKENIZE_GPT2
+                        : PRETOKENIZE_CL100K;
+            // LLaMa3 为 \p{N}{1,3}，Qwen2 为 \p{N}，GPT-2 为 ?\p{N}+
+            const std::string digits_prefix = "\\p{N}{1,";
+            auto pos = pattern.find(digits_prefix);
+            if (pos != std::string::npos)
+            {
+                max_digits = std::max(1, atoi(pattern.c_str() + pos + digits_prefix.size()));
+            }
+            else if (pattern.find("\\p{N}+") != std::string::npos)
+            {
+                max_digits = 0;
+            }
+            else
+            {
+                max_digits = 1;
+            }
+        }
+        else
+        {
+            ALOGE("pre_tokenizer %s is not supported", type.c_str());
+            return false;
+        }
+    }
+    if (!b_byte_level)
+    {
+        ALOGE("only byte-level BPE is supported, pre_tokenizer should contain ByteLevel");
+        return false;
+    }
+
+    auto byte_to_unicode = bytes_to_unicode();
+    std::vector<int> unicode_to_byte(512, -1);
+    for (int b = 0; b < 256; b++)
+    {
+        unicode_to_byte[byte_to_unicode[b]] = b;
+    }
+
+    // vocab
+    encoder.clear();
+    encoder.reserve(model["vocab"].size());
+    int max_id = -1;
+    std::string bytes;
+    for (auto &item : model["vocab"].items())
+    {
+        int id = item.value();
+        if (id < 0 || !byte_level_to_bytes(item.key(), unicode_to_byte, bytes))
+        {
+            continue;
+        }
+        encoder.emplace(bytes, id);
+        max_id = std::max(max_id, id);
+    }
+    for (auto &token : j["added_tokens"])
+    {
+        max_id = std::max(max_id, token.value("id", -1));
+    }
+    decoder.assign(max_id + 1, "");
+    special_flags.assign(max_id + 1, 0);
+    for (auto &kv : encoder)
+    {
+        decoder[kv.second] = kv.first;
+    }
+    for (int b = 0; b < 256; b++)
+    {
+        auto it = encoder.find(std::string(1, (char)b));
+        if (it == encoder.end())
+        {
+            ALOGE("byte 0x%02X is missing in vocab", b);
+            return false;
+        }
+        byte_ids[b] = it->second;
+    }
+    ignore_merges = model.value("ignore_merges", false);
+
+    // merges，先出现的优先合并
+    merges.clear();
+    merges.reserve(model["merges"].size());
+    int rank = 0, n_invalid = 0;
+    std::string left, right;
+    for (auto &merge : model["merges"])
+    {
+        std::string left_str, right_str;
+        if (merge.is_string())
+        {
+            std::string s = merge;
+            auto pos = s.find(' ');
+            if (pos == std::string::npos)
+            {
+                n_invalid++;
+                continue;
+            }
+            left_str = s.substr(0, pos);
+            right_str = s.substr(pos + 1);
+        }
+        else if (merge.is_array() && merge.size() == 2)
+        {
+            left_str = merge[0].get<std::string>();
+            right_str = merge[1].get<std::string>();
+        }
+        if (!byte_level_to_bytes(left_str, unicode_to_byte, left) || !byte_level_to_bytes(right_str, unicode_to_byte, right))
+        {
+            n_invalid++;
+            continue;
+        }
+        auto it_left = encoder.find(left);
+        auto it_right = encoder.find(right);
+        auto it_merged = encoder.find(left + right);
+        if (it_left == encoder.end() || it_right == encoder.end() || it_merged == encoder.end())
+        {
+            n_invalid++;
+            continue;
+        }
+        uint64_t key = (uint64_t)it_left->second << 32 | (uint32_t)it_right->second;
+        merges.emplace(key, std::make_pair(rank++, it_merged->second));
+    }
+    if (n_invalid)
+    {
+        ALOGW("%d merges are not in vocab, ignored", n_invalid);
+    }
+
+    // added tokens
+    added_tokens.clear();
+    memset(added_first_bytes, 0, sizeof(added_first_bytes));
+    for (auto &token : j["added_tokens"])
+    {
+        AddedToken added;
+        added.content = token.value("content", "");
+        added.id = token.value("id", -1);
+        if (added.content.empty() || added.id < 0)
+        {
+            continue;
+        }
+        decoder[added.id] = added.content;
+        special_flags[added.id] = token.value("special", false);
+        added_first_bytes[(unsigned char)added.content[0]] = true;
+        added_tokens.push_back(added);
+    }
+    std::stable_sort(added_tokens.begin(), added_tokens.end(), [](const AddedToken &a, const AddedToken &b)
+                     { return a.content.size() > b.content.size(); });
+
+    // bos/eos 取自同目录下的 tokenizer_config.json 和 generation_config.json
+    std::string dir = tokenizer_json_path.substr(0, tokenizer_json_path.find_last_of('/') + 1);
+    bos_id = eos_id = -1;
+    end_ids.clear();
+    nlohmann::json config;
+    if (read_json(dir + "tokenizer_config.json", config))
+    {
+        if (config.contains("bos_token"))
+            bos_id = token_to_id(read_token_content(config["bos_token"]));
+        if (config.contains("eos_token"))
+            eos_id = token_to_id(read_token_content(config["eos_token"]));
+    }
+    if (read_json(dir + "generation_config.json", config) && config.contains("eos_token_id"))
+    {
+        auto &ids = config["eos_token_id"];
+        for (auto &id : ids.is_array() ? ids : nlohmann::json::array({ids}))
+        {
+            if (id.is_number_integer())
+                end_ids.push_back(id.get<int>());
+        }
+    }
+    if (eos_id < 0 && !end_ids.empty())
+    {
+        eos_id = end_ids[0];
+    }
+    // 对话模型每轮以这些 token 结束，eos 往往是预训练时的 <|endoftext|>
+    for (auto name : {"<|endoftext|>", "<|end_of_text|>", "<|eot_id|>", "<|eom_id|>", "<|im_end|>", "<|end|>"})
+    {
+        int id = token_to_id(name);
+        if (id >= 0)
+            end_ids.push_back(id);
+    }
+    if (eos_id >= 0)
+    {
+        end_ids.push_back(eos_id);
+    }
+
+    ALOGI("bpe tokenizer: vocab %d, merges %d, added tokens %d, pre_tokenizer %s(digits %d), bos %d, eos %d",
+          (int)encoder.size(), (int)merges.size(), (int)added_tokens.size(),
+          style == PRETOKENIZE_GPT2 ? "gpt2" : "cl100k", max_digits, bos_id, eos_id);
+    return true;
+}
+
+int BPETokenizer::token_to_id(const std::string &token) const
+{
+    if (token.empty())
+    {
+        return -1;
+    }
+    for (auto &added : added_tokens)
+    {
+        if (added.content == token)
+        {
+            return added.id;
+        }
+    }
+    auto it = encoder.find(token);
+    return it == encoder.end() ? -1 : it->second;
+}
+
+bool BPETokenizer::is_special_id(int id) const
+{
+    return id >= 0 && id < (int)special_flags.size() && special_flags[id];
+}
+
+// 从 pos 开始的 's|'t|'re|'ve|'m|'ll|'d（不含 '），返回匹配的字节数
+static size_t match_contraction(std::string_view s, size_t pos, bool b_ignore_case)
+{
+    auto at = [&](size_t i) -> char
+    {
+        if (pos + i >= s.size())
+            return 0;
+        char c = s[pos + i];
+        return b_ignore_case && c >= 'A' && c <= 'Z' ? c + 32 : c;
+    };
+    char c0 = at(0), c1 = at(1);
+    if (c0 == 's' || c0 == 't' || c0 == 'm' || c0 == 'd')
+        return 1;
+    // 忽略大小写时 ſ (U+017F) 按 Unicode case folding 等同于 s
+    if (b_ignore_case && (unsigned char)c0 == 0xC5 && (unsigned char)c1 == 0xBF)
+        return 2;
+    if ((c0 == 'r' && c1 == 'e') || (c0 == 'v' && c1 == 'e') || (c0 == 'l' && c1 == 'l'))
+        return 2;
+    return 0;
+}
+
+std::vector<std::string_view> BPETokenizer::pretokenize(std::string_view text) const
+{
+    std::vector<std::string_view> pieces;
+    const size_t size = text.size();
+
+    auto cp_at = [&](size_t pos, size_t &len) -> uint32_t
+    {
+        if (pos >= size)
+        {
+            len = 0;
+            return 0;
+        }
+        return utf8_decode(text, pos, len);
+    };
+    auto is_other = [](uint32_t cp)
+    {
+        return !is_space(cp) && !is_letter(cp) && !is_number(cp);
+    };
+    auto is_newline = [](uint32_t cp)
+    {
+        return cp == '\r' || cp == '\n';
+    };
+    // 从 pos 开始连续满足 pred 的字符，最多 max_count 个（0 不限制），返回结束位置
+    auto skip = [&](size_t pos, auto pred, int max_count = 0) -> size_t
+    {
+        int count = 0;
+        size_t len;
+        while (pos < size && (max_count == 0 || count < max_count))
+        {
+            uint32_t cp = cp_at(pos, len);
+            if (!pred(cp))
+                break;
+            pos += len;
+            count++;
+        }
+        return pos;
+    };
+
+    size_t pos = 0;
+    while (pos < size)
+    {
+        size_t len0, len1;
+        uint32_t cp0 = cp_at(pos, len0);
+        uint32_t cp1 = cp_at(pos + len0, len1);
+        bool b_has_next = pos + len0 < size;
+        size_t end = 0;
+
+        if (cp0 == '\'' && (end = match_contraction(text, pos + 1, style == PRETOKENIZE_CL100K)))
+        {
+            end += pos + 1;
+        }
+        else if (style == PRETOKENIZE_CL100K)
+        {
+            if (is_letter(cp0))
+            {
+                // [^\r\n\p{L}\p{N}]?\p{L}+
+                end = skip(pos, is_letter);
+            }
+            else if (!is_newline(cp0) && !is_number(cp0) && b_has_next && is_letter(cp1))
+            {
+                end = skip(pos + len0, is_letter);
+            }
+            else if (is_number(cp0))
+            {
+                // \p{N}{1,3}
+                end = skip(pos, is_number, max_digits);
+            }
+            else if (is_other(cp0) || (cp0 == ' ' && b_has_next && is_other(cp1)))
+            {
+                // ?[^\s\p{L}\p{N}]+[\r\n]*
+                end = skip(cp0 == ' ' ? pos + len0 : pos, is_other);
+                end = skip(end, is_newline);
+            }
+        }
+        else
+        {
+            size_t start = cp0 == ' ' && b_has_next ? pos + len0 : pos;
+            uint32_t cp = cp0 == ' ' && b_has_next ? cp1 : cp0;
+            if (is_letter(cp))
+                end = skip(start, is_letter); // ?\p{L}+
+            else if (is_number(cp))
+                end = skip(start, is_number, max_digits); // ?\p{N}+
+            else if (is_other(cp))
+                end = skip(start, is_other); // ?[^\s\p{L}\p{N}]+
+        }
+
+        if (end == 0)
+        {
+            // 剩下的情况 cp0 都是空白
+            size_t run_end = pos, last_newline_end = 0, last_start = pos;
+            int count = 0;
+            while (run_end < size)
+            {
+                size_t len;
+                uint32_t cp = cp_at(run_end, len);
+                if (!is_space(cp))
+                    break;
+                last_start = run_end;
+                run_end += len;
+                count++;
+                if (is_newline(cp))
+                    last_newline_end = run_end;
+            }
+            if (style == PRETOKENIZE_CL100K && last_newline_end)
+            {
+                // \s*[\r\n]+：\s* 回溯到最后一个换行处
+                end = last_newline_end;
+            }
+            else if (run_end == size || count == 1)
+            {
+                // \s+(?!\S) 在末尾整体匹配，单个空白后接非空白时由 \s+ 匹配
+                end = run_end;
+            }
+            else
+            {
+                // \s+(?!\S)：回溯一个字符，把最后一个空白留给后面的词
+                end = last_start;
+            }
+        }
+
+        pieces.emplace_back(text.data() + pos, end - pos);
+        pos = end;
+    }
+    return pieces;
+}
+
+void BPETokenizer::encode_piece(std::string_view piece, std::vector<int> &output) const
+{
+    if (ignore_merges || piece.size() == 1)
+    {
+        auto it = encoder.find(piece);
+        if (it != encoder.end())
+        {
+            output.push_back(it->second);
+            return;
+        }
+    }
+
+    // symbols[start] 为从 start 开始的段当前对应的 token，合并时按 (左 token, 右 token) 查 merges
+    std::vector<int> symbols(piece.size());
+    for (size_t i = 0; i < piece.size(); i++)
+    {
+        symbols[i] = byte_ids[(unsigned char)piece[i]];
+    }
+    tiktoken::byte_pair_merge(
+        piece.size(),
+        [this, &symbols](int start, int mid, int end)
+        {
+            auto it = merges.find((uint64_t)symbols[start] << 32 | (uint32_t)symbols[mid]);
+            return it == merges.end() ? -1 : it->second.first;
+        },
+        [this, &symbols](int start, int mid, int end)
+        {
+            symbols[start] = merges.find((uint64_t)symbols[start] << 32 | (uint32_t)symbols[mid])->second.second;
+        },
+        [&symbols, &output](int start, int end)
+        { output.push_back(symbols[start]); });
+}
+
+void BPETokenizer::encode_segment(std::string_view text, std::vector<int> &output) const
+{
+    if (text.empty())
+    {
+        return;
+    }
+    std::string prefixed;
+    if (add_prefix_space && text[0] != ' ')
+    {
+        prefixed = " " + std::string(text);
+        text = prefixed;
+    }
+    for (auto &piece : pretokenize(text))
+    {
+        encode_piece(piece, output);
+    }
+}
+
+std::vector<int> BPETokenizer::encode(const std::string &text) const
+{
+    std::vector<int> output;
+    std::string_view view(text);
+    size_t segment_start = 0;
+    for (size_t pos = 0; pos < view.size();)
+    {
+        const AddedToken *matched = nullptr;
+        if (added_first_bytes[(unsigned char)view[pos]])
+        {
+            for (auto &added : added_tokens)
+            {
+                if (view.compare(pos, added.content.size(), added.content) == 0)
+                {
+                    matched = &added;
+                    break;
+                }
+            }
+        }
+        if (!matched)
+        {
+            pos++;
+            continue;
+        }
+        encode_segment(view.substr(segment_start, pos - segment_start), output);
+        output.push_back(matched->id);
+        pos += matched->content.size();
+        segment_start = pos;
+    }
+    encode_segment(view.substr(segment_start), output);
+    return output;
+}
+
+std::string BPETokenizer::decode(const std::vector<int> &ids) const
+{
+    std::string text;
+    for (auto id : ids)
+    {
+        if (id < 0 || id >= (int)decoder.size() || special_flags[id])
+        {
+            continue;
+        }
+        text += decoder[id];
+    }
+    return text;
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+#include "unordered_dense.h"
+
+// 加载 HuggingFace tokenizer.json 的 byte-level BPE tokenizer（GPT-2、LLaMa3、Qwen2 等），不依赖 python 和正则库
+// 支持的配置：
+// - model: BPE（merges 为 "a b" 字符串或 ["a", "b"] 数组，支持 ignore_merges）
+// - pre_tokenizer: ByteLevel，或 Split(Regex) + ByteLevel，正则按 GPT-2 / cl100k 两种写法手工实现
+// - decoder: ByteLevel
+// - added_tokens: 在预分词之前整体匹配
+// normalizer 不做处理，加载时给出警告
+class BPETokenizer
+{
+    // 支持用 string_view 直接查找，预分词得到的片段不需要拷贝
+    struct string_hash
+    {
+        using is_transparent = void;
+        using is_avalanching = void;
+        uint64_t operator()(std::string_view s) const noexcept
+        {
+            return ankerl::unordered_dense::hash<std::string_view>{}(s);
+        }
+    };
+
+public:
+    enum PretokenizeStyle
+    {
+        PRETOKENIZE_GPT2,   // 's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
+        PRETOKENIZE_CL100K, // (?i:'s|...)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+
+    };
+
+    bool load(const std::string &tokenizer_json_path);
+
+    // 不添加 bos/eos
+    std::vector<int> encode(const std::string &text) const;
+    // 跳过 special token
+    std::string decode(const std::vector<int> &ids) const;
+
+    // 按预分词规则切分，返回的 string_view 指向 text
+    std::vector<std::string_view> pretokenize(std::string_view text) const;
+
+    int token_to_id(const std::string &token) const;
+    bool is_special_id(int id) const;
+
+    int bos_id = -1;
+    int eos_id = -1;
+    std::vector<int> end_ids; // 对话结束时可能出现的 token，eos 之外还包括 <|eot_id|>、<|im_end|> 等
+
+private:
+    struct AddedToken
+    {
+        std::string content;
+        int id;
+    };
+
+    void encode_piece(std::string_view piece, std::vector<int> &output) const;
+    void encode_segment(std::string_view text, std::vector<int> &output) const;
+
+    ankerl::unordered_dense::map<std::string, int, string_hash, std::equal_to<>> encoder; // 原始字节 -> id
+    std::vector<std::string> decoder;   // id -> 原始字节
+    std::vector<uint8_t> special_flags; // id 是否为 special token
+    int byte_ids[256];                  // 单字节 token 的 id
+    // (left << 32 | right) -> (rank, merged id)
+    ankerl::unordered_dense::map<uint64_t, std::pair<int, int>> merges;
+    bool ignore_merges = false;
+
+    std::vector<AddedToken> added_tokens; // 按长度降序，优先匹配长的
+    bool added_first_bytes[256] = {false};
+
+    PretokenizeStyle style = PRETOKENIZE_CL100K;
+    int max_digits = 3; // \p{N}{1,max_digits}，0 表示不限制
+    bool add_prefix_space = false;
+};
@@ -7,8 +7,6 @@
 #include "sample_log.h"
 #include "base64.h"
 
-static const std::string PAT_STR = R"((?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?:$|[^\S])|\s+)";
-
 static std::pair<std::string, int> _parse(const std::string &line)
 {
     auto pos = line.find(" ");
@@ -31,8 +29,36 @@ static std::pair<std::string, int> _parse(const std::string &line)
     return {std::move(token), rank};
 }
 
+std::vector<std::string> QwenTokenizer::special_tokens()
+{
+    std::vector<std::string> special_tokens_s{"<|endoftext|>", "<|im_start|>", "<|im_end|>"};
+    char buffer[14];
+    for (size_t i = 0; i < 205; i++)
+    {
+        snprintf(buffer, 14, "<|extra_%zu|>", i);
+        special_tokens_s.push_back(buffer);
+    }
+    return special_tokens_s;
+}
+
 QwenTokenizer::QwenTokenizer(const std::string &tiktoken_path, const QwenConfig &config)
 {
+    eos_token_id = config.eos_token_id;
+    im_start_id = config.im_start_id;
+    im_end_id = config.im_end_id;
+
+    // tiktoken_compile 生成的二进制词表直接 mmap，special token 已经在词表中
+    if (tiktoken::binary_vocab::is_binary(tiktoken_path))
+    {
+        auto vocab = std::make_shared<tiktoken::binary_vocab>();
+        if (!vocab->load(tiktoken_path))
+        {
+            throw std::runtime_error("invalid binary encoder file: " + tiktoken_path);
+        }
+        tokenizer = tiktoken::tiktoken(std::move(vocab), tiktoken::QWEN_PAT_STR);
+        return;
+    }
+
     std::ifstream file(tiktoken_path);
     if (!file)
     {
@@ -51,25 +77,16 @@ QwenTokenizer::QwenTokenizer(const std::string &tiktoken_path, const QwenConfig
         }
     }
 
-    std::vector<std::string> special_tokens_s{"<|endoftext|>", "<|im_start|>", "<|im_end|>"};
-    char buffer[14];
-    for (size_t i = 0; i < 205; i++)
-    {
-        snprintf(buffer, 14, "<|extra_%zu|>", i);
-        special_tokens_s.push_back(buffer);
-    }
+    auto special_tokens_s = special_tokens();
     size_t encoder_size = encoder.size();
-    ankerl::unordered_dense::map<std::string, int> special_tokens;
-    special_tokens.reserve(special_tokens_s.size());
+    ankerl::unordered_dense::map<std::string, int> special_encoder;
+    special_encoder.reserve(special_tokens_s.size());
     for (size_t i = 0; i < special_tokens_s.size(); i++)
     {
-        special_tokens[special_tokens_s[i]] = encoder_size + i;
+        special_encoder[special_tokens_s[i]] = encoder_size + i;
     }
 
-    tokenizer = tiktoken::tiktoken(std::move(encoder), special_tokens, PAT_STR);
-    eos_token_id = config.eos_token_id;
-    im_start_id = config.im_start_id;
-    im_end_id = config.im_end_id;
+    tokenizer = tiktoken::tiktoken(std::move(encoder), special_encoder, tiktoken::QWEN_PAT_STR);
 }
 
 auto QwenTokenizer::build_prompt(const std::vector<std::string> &history) const -> std::string
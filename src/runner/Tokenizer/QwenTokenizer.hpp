@@ -15,8 +15,12 @@ struct QwenConfig
 class QwenTokenizer
 {
 public:
+    // tiktoken_path 为 qwen.tiktoken 文本，或 tools/tiktoken_compile 生成的二进制词表
     QwenTokenizer(const std::string &tiktoken_path, const QwenConfig &config);
 
+    // 追加在词表之后的 special token，id 从词表大小开始依次递增
+    static std::vector<std::string> special_tokens();
+
     auto encode(const std::string &text, int max_length) const -> std::vector<int>;
 
     auto decode(const std::vector<int> &ids) const -> std::string;
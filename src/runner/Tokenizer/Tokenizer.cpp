@@ -3,7 +3,10 @@
 // #include "sentencepiece_processor.h"
 // #include "builtin_pb/sentencepiece.pb.h"
 
-// #include "QwenTokenizer.hpp"
+#ifdef ENABLE_QWEN_TOKENIZER
+#include "QwenTokenizer.hpp"
+#endif
+#include "BPETokenizer.hpp"
 
 // #include "chatglm.h"
 
@@ -182,66 +185,100 @@
 //     }
 // };
 
-// class TokenizerQwen : public BaseTokenizer
-// {
-//     std::shared_ptr<QwenTokenizer> sp;
-//     bool _b_bos, _b_eos;
+#ifdef ENABLE_QWEN_TOKENIZER
+class TokenizerQwen : public BaseTokenizer
+{
+    std::shared_ptr<QwenTokenizer> sp;
+    bool _b_bos, _b_eos;
 
-// private:
-//     /* data */
-// public:
-//     bool Init(std::string model_path, bool b_bos = true, bool b_eos = false) override
-//     {
-//         if (!file_exist(model_path))
-//         {
-//             ALOGE("tokenizer model file(%s) not exist", model_path.c_str());
-//             return false;
-//         }
+private:
+    /* data */
+public:
+    // model_path 可以是 qwen.tiktoken，也可以是 tools/tiktoken_compile 生成的二进制词表（mmap 加载）
+    bool Init(std::string model_path, bool b_bos = true, bool b_eos = false) override
+    {
+        if (!file_exist(model_path))
+        {
+            ALOGE("tokenizer model file(%s) not exist", model_path.c_str());
+            return false;
+        }
 
-//         sp.reset(new QwenTokenizer(model_path, QwenConfig()));
+        try
+        {
+            sp.reset(new QwenTokenizer(model_path, QwenConfig()));
+        }
+        catch (const std::exception &e)
+        {
+            ALOGE("%s", e.what());
+            return false;
+        }
 
-//         this->_b_bos = b_bos;
-//         this->_b_eos = b_eos;
-//         return true;
-//     }
+        this->_b_bos = b_bos;
+        this->_b_eos = b_eos;
+        return true;
+    }
 
-//     bool Encode(std::string input, std::vector<int> &output, bool b_img_prompt = false) override
-//     {
-//         if (_b_bos)
-//         {
-//             // input += "<|im_start|>";
-//         }
-//         if (_b_eos)
-//         {
-//             input += "<|endoftext|>";
-//         }
-//         output = sp->encode(input, 1024);
+    ~TokenizerQwen()
+    {
+        if (sp)
+        {
+            auto stats = sp->tokenizer.cache_stats();
+            if (stats.capacity > 0)
+            {
+                ALOGI("tokenizer cache hits %llu, misses %llu, size %zu/%zu",
+                      (unsigned long long)stats.hits, (unsigned long long)stats.misses, stats.size, stats.capacity);
+            }
+        }
+    }
 
-//         return true;
-//     }
+    void SetCacheCapacity(int capacity) override
+    {
+        sp->tokenizer.set_cache_capacity(capacity);
+    }
 
-//     std::vector<int> Encode(std::string input, bool b_img_prompt = false) override
-//     {
-//         std::vector<int> output;
-//         Encode(input, output, b_img_prompt);
-//         return output;
-//     }
+    bool Encode(std::string input, std::vector<int> &output, bool b_img_prompt = false) override
+    {
+        if (_b_bos)
+        {
+            // input += "<|im_start|>";
+        }
+        if (_b_eos)
+        {
+            input += "<|endoftext|>";
+        }
+        output = sp->encode(input, 1024);
 
-//     std::string Decode(const std::vector<int> input) override
-//     {
-//         return sp->decode(input);
-//     }
+        return true;
+    }
 
-//     int GetBosID() override
-//     {
-//         return -1;
-//     }
+    std::vector<int> Encode(std::string input, bool b_img_prompt = false) override
+    {
+        std::vector<int> output;
+        Encode(input, output, b_img_prompt);
+        return output;
+    }
 
-//     int GetEosID() override
-//     {
-//         return sp->eos_token_id;
-//     }
-// };
+    std::string Decode(const std::vector<int> input) override
+    {
+        return sp->decode(input);
+    }
+
+    int GetBosID() override
+    {
+        return -1;
+    }
+
+    int GetEosID() override
+    {
+        return sp->eos_token_id;
+    }
+
+    bool isEnd(int id) override
+    {
+        return id == sp->eos_token_id || id == sp->im_end_id;
+    }
+};
+#endif
 
 // class TokenizerGLM3 : public BaseTokenizer
 // {
@@ -307,6 +344,76 @@
 //     }
 // };
 
+class TokenizerBPE : public BaseTokenizer
+{
+    BPETokenizer sp;
+    bool _b_bos, _b_eos;
+
+public:
+    bool Init(std::string model_path, bool b_bos = true, bool b_eos = false) override
+    {
+        if (!file_exist(model_path))
+        {
+            ALOGE("tokenizer model file(%s) not exist", model_path.c_str());
+            return false;
+        }
+        if (!sp.load(model_path))
+        {
+            return false;
+        }
+
+        this->_b_bos = b_bos;
+        this->_b_eos = b_eos;
+        return true;
+    }
+
+    bool Encode(std::string input, std::vector<int> &output, bool b_img_prompt = false) override
+    {
+        output = sp.encode(input);
+        if (_b_bos && sp.bos_id >= 0)
+        {
+            output.insert(output.begin(), sp.bos_id);
+        }
+        if (_b_eos && sp.eos_id >= 0)
+        {
+            output.push_back(sp.eos_id);
+        }
+        return true;
+    }
+
+    std::vector<int> Encode(std::string input, bool b_img_prompt = false) override
+    {
+        std::vector<int> output;
+        Encode(input, output, b_img_prompt);
+        return output;
+    }
+
+    std::string Decode(const std::vector<int> input) override
+    {
+        return sp.decode(input);
+    }
+
+    int GetBosID() override
+    {
+        return sp.bos_id;
+    }
+
+    int GetEosID() override
+    {
+        return sp.eos_id;
+    }
+
+    bool isEnd(int id) override
+    {
+        return std::find(sp.end_ids.begin(), sp.end_ids.end(), id) != sp.end_ids.end();
+    }
+
+    int GetTokenID(const std::string &token) override
+    {
+        return sp.token_to_id(token);
+    }
+};
+
 class Tokenizer_Http : public BaseTokenizer
 {
     std::shared_ptr<httplib::Client> cli;
@@ -465,8 +572,12 @@ std::shared_ptr<BaseTokenizer> CreateTokenizer(TokenizerType type)
     //     return std::make_shared<TokenizerMINICPM>();
     case TKT_HTTP:
         return std::make_shared<Tokenizer_Http>();
-    // case TKT_Qwen:
-    //     return std::make_shared<TokenizerQwen>();
+    case TKT_BPE:
+        return std::make_shared<TokenizerBPE>();
+#ifdef ENABLE_QWEN_TOKENIZER
+    case TKT_Qwen:
+        return std::make_shared<TokenizerQwen>();
+#endif
     // case TKT_Phi3:
     //     return std::make_shared<TokenizerPhi3>();
     default:
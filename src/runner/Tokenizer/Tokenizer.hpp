@@ -10,6 +10,7 @@ enum TokenizerType
     TKT_HTTP,
     TKT_Phi3,
     TKT_MINICPM,
+    TKT_BPE, // 本地加载 HuggingFace tokenizer.json 的 byte-level BPE
     TKT_END
 };
 
@@ -24,6 +25,10 @@ public:
     virtual int GetEosID() = 0;
 
     virtual bool isEnd(int id) { return id == GetEosID(); }
+    // 按字符串查找 token 的 id，不存在或不支持时返回 -1
+    virtual int GetTokenID(const std::string &token) { return -1; }
+    // 编码结果缓存的条数，0 表示不缓存，没有缓存的 tokenizer 忽略
+    virtual void SetCacheCapacity(int capacity) {}
 };
 
 std::shared_ptr<BaseTokenizer> CreateTokenizer(TokenizerType type);
\ No newline at end of file
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <functional>
+#include <limits>
+#include <queue>
+#include <utility>
+#include <vector>
+
+namespace tiktoken
+{
+	// 通用的 BPE 合并，tiktoken（按字节串查 rank）和 BPETokenizer（按相邻 token id 对查 merges）共用：
+	// 初始有 n 个段，第 i 段从位置 i 开始；每次合并 rank 最小的相邻两段（rank 相同时取最左边的），与逐段扫描的结果一致。
+	// 各段用双向链表连接，候选的相邻对放在小根堆中，合并后只更新左右两个相邻对，过期的候选在出堆时丢弃，整体 O(n log n)
+	// - get_rank(start, mid, end)：[start, mid) 与 [mid, end) 合并后的 rank，不能合并时返回 -1
+	// - on_merge(start, mid, end)：[start, mid) 与 [mid, end) 合并之后调用
+	// - on_part(start, end)：合并结束后按顺序对每一段调用
+	// 同一位置的段只会变长，合并后的内容不同，不会再次得到相同的 rank，出堆时比较 rank 即可判断候选是否过期
+	template <typename RankFunc, typename MergeFunc, typename PartFunc>
+	inline void byte_pair_merge(int n, RankFunc get_rank, MergeFunc on_merge, PartFunc on_part)
+	{
+		const int no_rank = std::numeric_limits<int>::max();
+
+		// prev/next 为相邻段的起始位置，最后一段的 next 为 n，被合并掉的段 next 为 -1
+		// rank 为本段与下一段合并后的 rank
+		struct part
+		{
+			int prev, next, rank;
+		};
+		std::vector<part> parts(n);
+		for (int i = 0; i < n; ++i)
+		{
+			parts[i] = {i - 1, i + 1, no_rank};
+		}
+
+		auto update_rank = [&parts, &get_rank, n, no_rank](int start)
+		{
+			int mid = parts[start].next;
+			int rank = -1;
+			if (mid < n)
+			{
+				rank = get_rank(start, mid, parts[mid].next);
+			}
+			parts[start].rank = rank >= 0 ? rank : no_rank;
+			return parts[start].rank;
+		};
+
+		typedef std::pair<int, int> candidate; // (rank, start)
+		std::vector<candidate> heap_data;
+		heap_data.reserve(n);
+		std::priority_queue<candidate, std::vector<candidate>, std::greater<candidate>> heap(std::greater<candidate>(), std::move(heap_data));
+		for (int i = 0; i + 1 < n; ++i)
+		{
+			if (update_rank(i) != no_rank)
+			{
+				heap.emplace(parts[i].rank, i);
+			}
+		}
+
+		while (!heap.empty())
+		{
+			auto [rank, start] = heap.top();
+			heap.pop();
+			if (parts[start].next < 0 || parts[start].rank != rank)
+			{
+				continue;
+			}
+
+			int mid = parts[start].next;
+			int end = parts[mid].next;
+			parts[start].next = end;
+			parts[mid].next = -1;
+			if (end < n)
+			{
+				parts[end].prev = start;
+			}
+			on_merge(start, mid, end);
+
+			if (update_rank(start) != no_rank)
+			{
+				heap.emplace(parts[start].rank, start);
+			}
+			int prev = parts[start].prev;
+			if (prev >= 0 && update_rank(prev) != no_rank)
+			{
+				heap.emplace(parts[prev].rank, prev);
+			}
+		}
+
+		for (int i = 0; i < n; i = parts[i].next)
+		{
+			on_part(i, parts[i].next);
+		}
+	}
+
+} // namespace tiktoken
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include "unicode_category.h"
+
+namespace tiktoken
+{
+	static const std::string QWEN_PAT_STR = R"((?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?:$|[^\S])|\s+)";
+
+	// QWEN_PAT_STR 的手写实现，切分结果与 RE2 FindAndConsume 逐字节一致（tools/qwen_pretokenize_check 校验）：
+	// - RE2 的 \s 只有 [\t\n\f\r ]，\v 和 Unicode 空白都属于 [^\s\p{L}\p{N}]
+	// - \s+(?:$|[^\S]) 回溯一个字符后仍然匹配整段空白，所以不含换行的空白总是整段切出
+	// - 非法的 UTF-8 字节任何分支都匹配不到，RE2 直接跳过，这里同样丢弃
+	// 片段以 string_view 返回，指向输入文本
+	class qwen_pretokenizer
+	{
+	public:
+		explicit qwen_pretokenizer(std::string_view text) : text_(text) {}
+
+		// 取下一个片段，没有时返回 false
+		bool next(std::string_view &piece)
+		{
+			while (pos_ < text_.size())
+			{
+				size_t len;
+				uint32_t cp = decode(pos_, len);
+				if (cp == unicode_category::invalid_codepoint)
+				{
+					pos_ += len;
+					continue;
+				}
+				size_t end = match(pos_, cp, len);
+				piece = text_.substr(pos_, end - pos_);
+				pos_ = end;
+				return true;
+			}
+			return false;
+		}
+
+	private:
+		enum category
+		{
+			CAT_INVALID,
+			CAT_LETTER, // \p{L}
+			CAT_NUMBER, // \p{N}
+			CAT_SPACE,  // \s
+			CAT_OTHER,  // [^\s\p{L}\p{N}]
+		};
+
+		static category category_of(uint32_t cp)
+		{
+			if (cp < 0x80)
+			{
+				// ASCII 不查表
+				if ((cp | 0x20) >= 'a' && (cp | 0x20) <= 'z')
+					return CAT_LETTER;
+				if (cp >= '0' && cp <= '9')
+					return CAT_NUMBER;
+				if (cp == ' ' || cp == '\t' || cp == '\n' || cp == '\f' || cp == '\r')
+					return CAT_SPACE;
+				return CAT_OTHER;
+			}
+			if (cp == unicode_category::invalid_codepoint)
+				return CAT_INVALID;
+			if (unicode_category::is_letter(cp))
+				return CAT_LETTER;
+			if (unicode_category::is_number(cp))
+				return CAT_NUMBER;
+			return CAT_OTHER;
+		}
+
+		static bool is_newline(uint32_t cp)
+		{
+			return cp == '\r' || cp == '\n';
+		}
+
+		uint32_t decode(size_t pos, size_t &len) const
+		{
+			if (pos >= text_.size())
+			{
+				len = 0;
+				return unicode_category::invalid_codepoint;
+			}
+			unsigned char c = text_[pos];
+			if (c < 0x80)
+			{
+				len = 1;
+				return c;
+			}
+			return unicode_category::utf8_decode(text_, pos, len);
+		}
+
+		// 从 pos 开始跳过类别为 cat 的字符，返回结束位置
+		size_t skip(size_t pos, category cat) const
+		{
+			size_t len;
+			while (pos < text_.size())
+			{
+				uint32_t cp = decode(pos, len);
+				if (category_of(cp) != cat)
+					break;
+				pos += len;
+			}
+			return pos;
+		}
+
+		size_t skip_newlines(size_t pos) const
+		{
+			while (pos < text_.size() && is_newline((unsigned char)text_[pos]))
+				pos++;
+			return pos;
+		}
+
+		// (?i:'s|'t|'re|'ve|'m|'ll|'d)，pos 为 ' 之后的位置，返回匹配的字节数；忽略大小写时 ſ (U+017F) 等同于 s
+		size_t match_contraction(size_t pos) const
+		{
+			auto at = [this, pos](size_t i) -> unsigned char
+			{
+				if (pos + i >= text_.size())
+					return 0;
+				unsigned char c = text_[pos + i];
+				return c >= 'A' && c <= 'Z' ? c + 32 : c;
+			};
+			unsigned char c0 = at(0), c1 = at(1);
+			if (c0 == 's' || c0 == 't' || c0 == 'm' || c0 == 'd')
+				return 1;
+			if ((c0 == 0xC5 && c1 == 0xBF) || (c0 == 'r' && c1 == 'e') || (c0 == 'v' && c1 == 'e') || (c0 == 'l' && c1 == 'l'))
+				return 2;
+			return 0;
+		}
+
+		// 按分支顺序匹配 pos 处的片段，cp0 为 pos 处的合法字符，返回结束位置
+		size_t match(size_t pos, uint32_t cp0, size_t len0) const
+		{
+			if (cp0 == '\'')
+			{
+				size_t n = match_contraction(pos + 1);
+				if (n)
+					return pos + 1 + n;
+			}
+
+			// [^\r\n\p{L}\p{N}]?\p{L}+
+			category cat0 = category_of(cp0);
+			if (cat0 == CAT_LETTER)
+				return skip(pos, CAT_LETTER);
+			size_t len1;
+			category cat1 = category_of(decode(pos + len0, len1));
+			if (!is_newline(cp0) && cat0 != CAT_NUMBER && cat1 == CAT_LETTER)
+				return skip(pos + len0, CAT_LETTER);
+
+			// \p{N}
+			if (cat0 == CAT_NUMBER)
+				return pos + len0;
+
+			// ?[^\s\p{L}\p{N}]+[\r\n]*
+			if (cat0 == CAT_OTHER || (cp0 == ' ' && cat1 == CAT_OTHER))
+				return skip_newlines(skip(cp0 == ' ' ? pos + 1 : pos, CAT_OTHER));
+
+			// \s*[\r\n]+：\s* 回溯到这段空白中最后一个换行；没有换行时 \s+(?:$|[^\S]) 或 \s+ 匹配整段空白
+			size_t end = skip(pos, CAT_SPACE);
+			for (size_t i = end; i > pos; i--)
+			{
+				if (is_newline((unsigned char)text_[i - 1]))
+					return i;
+			}
+			return end;
+		}
+
+		std::string_view text_;
+		size_t pos_ = 0;
+	};
+
+} // namespace tiktoken
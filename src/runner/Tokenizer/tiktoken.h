@@ -2,11 +2,19 @@
 
 #include <re2/re2.h>
 #include "unordered_dense.h"
+#include "tiktoken_bin.h"
+#include "qwen_pretokenizer.h"
+#include "bpe_merge.h"
 
 #include <cassert>
+#include <functional>
 #include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <regex>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
@@ -15,120 +23,132 @@
 namespace tiktoken
 {
 
+	// 字节串本身就是 token，按 [start, end) 的字节查 rank
 	static auto _byte_pair_merge(
-		const std::string &piece,
-		const ankerl::unordered_dense::map<std::string, int> &ranks,
+		std::string_view piece,
+		const binary_vocab &ranks,
 		std::function<int(int, int)> func) -> std::vector<int>
 	{
-		std::vector<std::pair<int, int>> parts;
-		parts.reserve(piece.size() + 1);
-		for (auto idx = 0U; idx < piece.size() + 1; ++idx)
+		std::vector<int> out;
+		byte_pair_merge(
+			piece.size(),
+			[&piece, &ranks](int start, int mid, int end)
+			{ return ranks.find(piece.substr(start, end - start)); },
+			[](int start, int mid, int end) {},
+			[&out, &func](int start, int end)
+			{ out.push_back(func(start, end)); });
+		return out;
+	}
+
+	static auto byte_pair_encode(
+		std::string_view piece,
+		const binary_vocab &ranks) -> std::vector<int>
+	{
+		if (piece.size() == 1)
 		{
-			parts.emplace_back(idx, std::numeric_limits<int>::max());
+			return {ranks.find(piece)};
 		}
 
-		auto get_rank = [&piece, &ranks](
-							const std::vector<std::pair<int, int>> &parts,
-							int start_idx,
-							int skip) -> std::optional<int>
+		auto func = [&piece, &ranks](int start, int stop) -> int
 		{
-			if (start_idx + skip + 2 < parts.size())
-			{
-				auto s = parts[start_idx].first;
-				auto e = parts[start_idx + skip + 2].first;
-				auto key = piece.substr(s, e - s);
-				auto iter = ranks.find(key);
-				if (iter != ranks.end())
-				{
-					return iter->second;
-				}
-			}
-			return std::nullopt;
+			return ranks.find(piece.substr(start, stop - start));
 		};
 
-		for (auto i = 0U; i < parts.size() - 2; ++i)
-		{
-			auto rank = get_rank(parts, i, 0);
-			if (rank)
-			{
-				assert(*rank != std::numeric_limits<int>::max());
-				parts[i].second = *rank;
-			}
-		}
+		return _byte_pair_merge(piece, ranks, func);
+	}
 
-		while (true)
+	// 最近用过的 BPE 结果（LRU），长文档和多轮对话历史中反复出现的词不必每次重新合并；多线程共用一个 tokenizer 时加锁访问
+	class piece_cache
+	{
+	public:
+		struct stats
 		{
-			if (parts.size() == 1)
-				break;
+			uint64_t hits = 0;
+			uint64_t misses = 0;
+			size_t size = 0;
+			size_t capacity = 0;
+		};
+
+		// 过长的片段（base64、长 URL 等）很少重复，不缓存，避免把常用的词挤出去
+		static const size_t max_piece_size = 256;
 
-			auto min_rank = std::make_pair<int, int>(std::numeric_limits<int>::max(), 0);
-			for (auto i = 0U; i < parts.size() - 1; ++i)
+		explicit piece_cache(size_t capacity) : capacity_(capacity) {}
+
+		// 命中时把 token 追加到 out
+		bool get(std::string_view piece, std::vector<int> &out)
+		{
+			if (piece.size() > max_piece_size)
 			{
-				auto rank = parts[i].second;
-				if (rank < min_rank.first)
-				{
-					min_rank = {rank, i};
-				}
+				return false;
 			}
-
-			if (min_rank.first != std::numeric_limits<int>::max())
+			std::lock_guard<std::mutex> lock(mtx_);
+			auto iter = index_.find(piece);
+			if (iter == index_.end())
 			{
-				auto i = min_rank.second;
-				auto rank = get_rank(parts, i, 1);
-				if (rank)
-				{
-					parts[i].second = *rank;
-				}
-				else
-				{
-					parts[i].second = std::numeric_limits<int>::max();
-				}
-				if (i > 0)
-				{
-					auto rank = get_rank(parts, i - 1, 1);
-					if (rank)
-					{
-						parts[i - 1].second = *rank;
-					}
-					else
-					{
-						parts[i - 1].second = std::numeric_limits<int>::max();
-					}
-				}
+				misses_++;
+				return false;
+			}
+			hits_++;
+			items_.splice(items_.begin(), items_, iter->second);
+			out.insert(out.end(), iter->second->second.begin(), iter->second->second.end());
+			return true;
+		}
 
-				parts.erase(parts.begin() + (i + 1));
+		void put(std::string_view piece, const std::vector<int> &tokens)
+		{
+			if (piece.size() > max_piece_size)
+			{
+				return;
 			}
-			else
+			std::lock_guard<std::mutex> lock(mtx_);
+			if (capacity_ == 0 || index_.find(piece) != index_.end())
 			{
-				break;
+				return;
 			}
+			items_.emplace_front(std::string(piece), tokens);
+			index_.emplace(items_.front().first, items_.begin());
+			evict();
 		}
-		std::vector<int> out;
-		out.reserve(parts.size() - 1);
-		for (auto i = 0U; i < parts.size() - 1; ++i)
+
+		// 0 表示关闭缓存
+		void set_capacity(size_t capacity)
 		{
-			out.push_back(func(parts[i].first, parts[i + 1].first));
+			std::lock_guard<std::mutex> lock(mtx_);
+			capacity_ = capacity;
+			evict();
 		}
-		return out;
-	}
 
-	static auto byte_pair_encode(
-		const std::string &piece,
-		const ankerl::unordered_dense::map<std::string, int> &ranks) -> std::vector<int>
-	{
-		if (piece.size() == 1)
+		stats get_stats()
 		{
-			return {ranks.at(piece)};
+			std::lock_guard<std::mutex> lock(mtx_);
+			stats s;
+			s.hits = hits_;
+			s.misses = misses_;
+			s.size = items_.size();
+			s.capacity = capacity_;
+			return s;
 		}
 
-		auto func = [&piece, &ranks](int start, int stop) -> int
+	private:
+		void evict()
 		{
-			std::string key = piece.substr(start, stop - start);
-			return ranks.at(key);
-		};
+			while (items_.size() > capacity_)
+			{
+				index_.erase(std::string_view(items_.back().first));
+				items_.pop_back();
+			}
+		}
 
-		return _byte_pair_merge(piece, ranks, func);
-	}
+		typedef std::list<std::pair<std::string, std::vector<int>>> item_list;
+
+		std::mutex mtx_;
+		size_t capacity_;
+		item_list items_; // 按最近使用排序，最前面的最新
+		// key 指向 items_ 中的字符串，list 的节点地址不变
+		ankerl::unordered_dense::map<std::string_view, item_list::iterator> index_;
+		uint64_t hits_ = 0;
+		uint64_t misses_ = 0;
+	};
 
 	class tiktoken
 	{
@@ -139,40 +159,18 @@ namespace tiktoken
 			ankerl::unordered_dense::map<std::string, int> special_encoder,
 			const std::string &pattern)
 		{
-			regex_ = std::make_unique<re2::RE2>("(" + pattern + ")");
-
-			std::string special_pattern;
-			for (const auto &item : special_encoder)
+			auto vocab = std::make_shared<binary_vocab>();
+			if (!vocab->load(binary_vocab::build(encoder, special_encoder)))
 			{
-				if (!special_pattern.empty())
-				{
-					special_pattern += "|";
-				}
-				special_pattern += re2::RE2::QuoteMeta(item.first);
+				throw std::runtime_error("invalid encoder, all 256 single bytes are required");
 			}
-			if (special_pattern.empty())
-			{
-				special_regex_ = nullptr;
-			}
-			else
-			{
-				special_regex_ = std::make_unique<re2::RE2>("(" + special_pattern + ")");
-			}
-
-			encoder_ = std::move(encoder);
-			special_tokens_encoder = std::move(special_encoder);
-
-			for (const auto &[k, v] : encoder_)
-			{
-				decoder_.emplace(v, k);
-			}
-			// 不知道有什么用 debug会报错，先注释了再说
-			// assert(encoder_.size() != decoder_.size() && "Encoder and decoder must be of equal length; maybe you had duplicate token indices in your encoder?");
+			init(std::move(vocab), pattern);
+		}
 
-			for (const auto &[k, v] : special_tokens_encoder)
-			{
-				special_tokens_decoder.emplace(v, k);
-			}
+		// 使用 tiktoken_compile 生成并 mmap 加载的词表
+		tiktoken(std::shared_ptr<const binary_vocab> vocab, const std::string &pattern)
+		{
+			init(std::move(vocab), pattern);
 		}
 
 		auto encode_ordinary(const std::string &text) const -> std::vector<int>
@@ -182,17 +180,14 @@ namespace tiktoken
 
 		auto encode(const std::string &text) const -> std::vector<int>
 		{
-			return _encode_native(text, special_tokens_encoder).first;
+			return _encode_native(text).first;
 		}
 
 		auto encode_single_piece(const std::string &text) const -> std::vector<int>
 		{
-			auto iter = encoder_.find(text);
-			if (iter != encoder_.end())
-			{
-				return {iter->second};
-			}
-			return byte_pair_encode(text, encoder_);
+			std::vector<int> ret;
+			_encode_piece(text, ret);
+			return ret;
 		}
 
 		auto decode(const std::vector<int> &tokens) const -> std::string
@@ -200,82 +195,131 @@ namespace tiktoken
 			return _decode_native(tokens);
 		}
 
-	private:
-		auto split_with_allowed_special_token(
-			re2::StringPiece &input,
-			const ankerl::unordered_dense::map<std::string, int> &allowed_special) const -> std::pair<std::optional<std::string>, re2::StringPiece>
+		// 不在词表中、需要 BPE 合并的片段的缓存条数，0 表示关闭
+		void set_cache_capacity(size_t capacity)
 		{
-			if (special_regex_ == nullptr)
-				return {std::nullopt, input};
+			cache_->set_capacity(capacity);
+		}
 
-			auto start = input.begin();
-			std::string special;
-			while (true)
+		// hits/misses 只统计需要 BPE 合并的片段
+		auto cache_stats() const -> piece_cache::stats
+		{
+			return cache_->get_stats();
+		}
+
+	private:
+		void init(std::shared_ptr<const binary_vocab> vocab, const std::string &pattern)
+		{
+			// Qwen 的正则有手写实现，不用编译 RE2
+			regex_ = pattern == QWEN_PAT_STR ? nullptr : std::make_unique<re2::RE2>("(" + pattern + ")");
+			vocab_ = std::move(vocab);
+			cache_ = std::make_shared<piece_cache>(4096);
+
+			// special token 按长度降序逐个比较，不再为几百个 special token 编译一个很大的正则
+			special_tokens_.clear();
+			memset(special_first_bytes_, 0, sizeof(special_first_bytes_));
+			for (auto id : vocab_->special_ids())
 			{
-				if (!re2::RE2::FindAndConsume(&input, *special_regex_, &special))
+				auto token = vocab_->piece(id);
+				if (token.empty())
 				{
-					break;
+					continue;
 				}
+				special_tokens_.emplace_back(token, id);
+				special_first_bytes_[(uint8_t)token[0]] = true;
+			}
+			std::stable_sort(special_tokens_.begin(), special_tokens_.end(), [](const auto &a, const auto &b)
+							 { return a.first.size() > b.first.size(); });
+		}
 
-				if (allowed_special.count(special) == 1)
+		// 找到 input 中第一个 special token，返回它的 id 和之前的文本，并从 input 中去掉这两部分；没有时返回 -1 和整个 input
+		auto split_with_special_token(std::string_view &input) const -> std::pair<int, std::string_view>
+		{
+			for (size_t pos = 0; pos < input.size(); pos++)
+			{
+				if (!special_first_bytes_[(uint8_t)input[pos]])
+				{
+					continue;
+				}
+				auto rest = input.substr(pos);
+				for (const auto &[token, id] : special_tokens_)
 				{
-					return {std::move(special), re2::StringPiece(start, input.begin() - start - special.size())};
+					if (rest.substr(0, token.size()) == token)
+					{
+						auto before = input.substr(0, pos);
+						input.remove_prefix(pos + token.size());
+						return {id, before};
+					}
 				}
 			}
-
-			return {std::nullopt, input};
+			return {-1, input};
 		}
 
-		auto _encode_ordinary_native(const std::string &text) const -> std::vector<int>
+		// 把一个预分词片段的 token 追加到 ret，返回追加的个数
+		auto _encode_piece(std::string_view piece, std::vector<int> &ret) const -> int
 		{
-			std::vector<int> ret;
-			re2::StringPiece input(text);
+			auto rank = vocab_->find(piece);
+			if (rank >= 0)
+			{
+				ret.push_back(rank);
+				return 1;
+			}
+			size_t size = ret.size();
+			if (cache_->get(piece, ret))
+			{
+				return ret.size() - size;
+			}
+			auto tokens = byte_pair_encode(piece, *vocab_);
+			cache_->put(piece, tokens);
+			ret.insert(ret.end(), tokens.begin(), tokens.end());
+			return tokens.size();
+		}
 
-			std::string piece;
-			while (re2::RE2::FindAndConsume(&input, *regex_, &piece))
+		// 按预分词规则切分 text，依次对每个片段调用 func
+		template <typename Func>
+		void _for_each_piece(std::string_view text, Func func) const
+		{
+			std::string_view piece;
+			if (!regex_)
 			{
-				auto iter = encoder_.find(piece);
-				if (iter != encoder_.end())
+				qwen_pretokenizer pretokenizer(text);
+				while (pretokenizer.next(piece))
 				{
-					ret.push_back(iter->second);
-					continue;
+					func(piece);
 				}
-				auto tokens = byte_pair_encode(piece, encoder_);
-				ret.insert(ret.end(), tokens.begin(), tokens.end());
+				return;
+			}
+			re2::StringPiece input(text.data(), text.size());
+			re2::StringPiece match;
+			while (re2::RE2::FindAndConsume(&input, *regex_, &match))
+			{
+				func(std::string_view(match.data(), match.size()));
 			}
+		}
+
+		auto _encode_ordinary_native(const std::string &text) const -> std::vector<int>
+		{
+			std::vector<int> ret;
+			_for_each_piece(text, [this, &ret](std::string_view piece)
+							{ _encode_piece(piece, ret); });
 			return ret;
 		}
 
-		auto _encode_native(
-			const std::string &text,
-			const ankerl::unordered_dense::map<std::string, int> &allowed_special) const -> std::pair<std::vector<int>, int>
+		auto _encode_native(const std::string &text) const -> std::pair<std::vector<int>, int>
 		{
 			std::vector<int> ret;
 			int last_piece_token_len = 0;
-			re2::StringPiece input(text);
+			std::string_view input(text);
 
 			while (true)
 			{
-				auto [special, sub_input] = split_with_allowed_special_token(input, allowed_special);
-				std::string piece;
-				while (re2::RE2::FindAndConsume(&sub_input, *regex_, &piece))
-				{
-					auto iter = encoder_.find(piece);
-					if (iter != encoder_.end())
-					{
-						last_piece_token_len = 1;
-						ret.push_back(iter->second);
-						continue;
-					}
-					auto tokens = byte_pair_encode(piece, encoder_);
-					last_piece_token_len = tokens.size();
-					ret.insert(ret.end(), tokens.begin(), tokens.end());
-				}
+				auto [special, sub_input] = split_with_special_token(input);
+				_for_each_piece(sub_input, [this, &ret, &last_piece_token_len](std::string_view piece)
+								{ last_piece_token_len = _encode_piece(piece, ret); });
 
-				if (special)
+				if (special >= 0)
 				{
-					int token = special_tokens_encoder.at(*special);
-					ret.push_back(token);
+					ret.push_back(special);
 					last_piece_token_len = 0;
 				}
 				else
@@ -293,35 +337,21 @@ namespace tiktoken
 			ret.reserve(tokens.size() * 2);
 			for (auto token : tokens)
 			{
-				std::string token_bytes;
-				auto iter = decoder_.find(token);
-				if (iter != decoder_.end())
+				if (!vocab_->contains(token))
 				{
-					token_bytes = iter->second;
-				}
-				else
-				{
-					iter = special_tokens_decoder.find(token);
-					if (iter != special_tokens_decoder.end())
-					{
-						token_bytes = iter->second;
-					}
-					else
-					{
-						throw std::runtime_error("unknown token: " + std::to_string(token));
-					}
+					throw std::runtime_error("unknown token: " + std::to_string(token));
 				}
-				ret += token_bytes;
+				auto token_bytes = vocab_->piece(token);
+				ret.append(token_bytes.data(), token_bytes.size());
 			}
 			return ret;
 		}
 
-		ankerl::unordered_dense::map<std::string, int> encoder_;
-		ankerl::unordered_dense::map<std::string, int> special_tokens_encoder;
-		ankerl::unordered_dense::map<int, std::string> decoder_;
-		ankerl::unordered_dense::map<int, std::string> special_tokens_decoder;
-		std::unique_ptr<re2::RE2> regex_;
-		std::unique_ptr<re2::RE2> special_regex_;
+		std::shared_ptr<const binary_vocab> vocab_;
+		std::shared_ptr<piece_cache> cache_;
+		std::vector<std::pair<std::string_view, int>> special_tokens_;
+		bool special_first_bytes_[256] = {false};
+		std::unique_ptr<re2::RE2> regex_; // 为空时使用 qwen_pretokenizer
 	};
 
 } // namespace tiktoken
@@ -0,0 +1,278 @@
+#pragma once
+
+#include "unordered_dense.h"
+#include "memory_utils.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace tiktoken
+{
+	// 离线编译的 tiktoken 词表，加载时直接 mmap，不需要解析 base64 文本和构建哈希表，多个进程共享同一份物理内存
+	// 文件布局（小端，各段 8 字节对齐）：
+	//   header
+	//   pieces   n_ids * {uint32 offset, uint32 size}，id 对应的字节在 arena 中的位置，size 为 UINT32_MAX 表示 id 不存在
+	//   sorted   n_sorted * uint32，长度 >= 2 的普通 token 按字节序排序后的 id
+	//   buckets  65537 * uint32，前两个字节为 b 的 token 在 sorted 中的区间 [buckets[b], buckets[b + 1])
+	//   bytes    256 * int32，单字节 token 的 id，-1 表示不存在，加载时要求 256 个字节都存在
+	//   special  n_special * uint32，special token 的 id
+	//   arena    所有 token 的字节
+	// 普通 token 的 id 就是 BPE 合并的 rank
+	struct binary_header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t n_ids;
+		uint32_t n_sorted;
+		uint32_t n_special;
+		uint64_t pieces_offset;
+		uint64_t sorted_offset;
+		uint64_t buckets_offset;
+		uint64_t bytes_offset;
+		uint64_t special_offset;
+		uint64_t arena_offset;
+		uint64_t arena_size;
+	};
+
+	static const char BINARY_MAGIC[8] = {'A', 'X', 'T', 'I', 'K', 'T', 'O', 'K'};
+	static const uint32_t BINARY_VERSION = 1;
+	static const uint32_t BINARY_BUCKETS = 65536;
+
+	class binary_vocab
+	{
+	public:
+		binary_vocab() = default;
+		binary_vocab(const binary_vocab &) = delete;
+		binary_vocab &operator=(const binary_vocab &) = delete;
+
+		static bool is_binary(const std::string &path)
+		{
+			char magic[sizeof(BINARY_MAGIC)] = {0};
+			std::ifstream file(path, std::ios::binary);
+			return file.read(magic, sizeof(magic)) && memcmp(magic, BINARY_MAGIC, sizeof(magic)) == 0;
+		}
+
+		// 由 token -> id 的表生成二进制词表
+		static auto build(
+			const ankerl::unordered_dense::map<std::string, int> &encoder,
+			const ankerl::unordered_dense::map<std::string, int> &special_encoder) -> std::vector<char>
+		{
+			uint32_t n_ids = 0;
+			for (const auto &[k, v] : encoder)
+				n_ids = std::max(n_ids, (uint32_t)v + 1);
+			for (const auto &[k, v] : special_encoder)
+				n_ids = std::max(n_ids, (uint32_t)v + 1);
+
+			std::vector<uint32_t> pieces(n_ids * 2, 0);
+			for (uint32_t i = 0; i < n_ids; i++)
+				pieces[i * 2 + 1] = UINT32_MAX;
+			std::string arena;
+			auto add_piece = [&](const std::string &token, int id)
+			{
+				pieces[id * 2] = arena.size();
+				pieces[id * 2 + 1] = token.size();
+				arena += token;
+			};
+
+			std::vector<uint32_t> sorted;
+			std::vector<int32_t> bytes(256, -1);
+			for (const auto &[k, v] : encoder)
+			{
+				add_piece(k, v);
+				if (k.size() == 1)
+					bytes[(uint8_t)k[0]] = v;
+				else if (k.size() > 1)
+					sorted.push_back(v);
+			}
+			auto piece = [&](uint32_t id)
+			{
+				return std::string_view(arena.data() + pieces[id * 2], pieces[id * 2 + 1]);
+			};
+			std::sort(sorted.begin(), sorted.end(), [&](uint32_t a, uint32_t b)
+					  { return piece(a) < piece(b); });
+
+			std::vector<uint32_t> buckets(BINARY_BUCKETS + 1, 0);
+			for (auto id : sorted)
+				buckets[bucket_of(piece(id)) + 1]++;
+			for (uint32_t b = 0; b < BINARY_BUCKETS; b++)
+				buckets[b + 1] += buckets[b];
+
+			std::vector<uint32_t> special;
+			for (const auto &[k, v] : special_encoder)
+			{
+				add_piece(k, v);
+				special.push_back(v);
+			}
+			std::sort(special.begin(), special.end());
+
+			binary_header header;
+			memset(&header, 0, sizeof(header));
+			memcpy(header.magic, BINARY_MAGIC, sizeof(BINARY_MAGIC));
+			header.version = BINARY_VERSION;
+			header.n_ids = n_ids;
+			header.n_sorted = sorted.size();
+			header.n_special = special.size();
+
+			std::vector<char> data(sizeof(header));
+			auto append = [&data](const void *src, size_t size) -> uint64_t
+			{
+				data.resize((data.size() + 7) / 8 * 8);
+				uint64_t offset = data.size();
+				data.insert(data.end(), (const char *)src, (const char *)src + size);
+				return offset;
+			};
+			header.pieces_offset = append(pieces.data(), pieces.size() * sizeof(uint32_t));
+			header.sorted_offset = append(sorted.data(), sorted.size() * sizeof(uint32_t));
+			header.buckets_offset = append(buckets.data(), buckets.size() * sizeof(uint32_t));
+			header.bytes_offset = append(bytes.data(), bytes.size() * sizeof(int32_t));
+			header.special_offset = append(special.data(), special.size() * sizeof(uint32_t));
+			header.arena_offset = append(arena.data(), arena.size());
+			header.arena_size = arena.size();
+			memcpy(data.data(), &header, sizeof(header));
+			return data;
+		}
+
+		// mmap 只读加载
+		bool load(const std::string &path)
+		{
+			if (!mmap_.open_file(path.c_str(), true))
+			{
+				return false;
+			}
+			return attach((const char *)mmap_.data(), mmap_.size());
+		}
+
+		bool load(std::vector<char> data)
+		{
+			buffer_ = std::move(data);
+			return attach(buffer_.data(), buffer_.size());
+		}
+
+		// 不存在时返回 -1
+		int find(std::string_view key) const
+		{
+			if (key.size() < 2)
+			{
+				return key.empty() ? -1 : bytes_[(uint8_t)key[0]];
+			}
+			auto b = bucket_of(key);
+			auto first = sorted_ + buckets_[b], last = sorted_ + buckets_[b + 1];
+			auto it = std::lower_bound(first, last, key, [this](uint32_t id, std::string_view k)
+									   { return piece(id) < k; });
+			return it != last && piece(*it) == key ? (int)*it : -1;
+		}
+
+		bool contains(int id) const
+		{
+			return id >= 0 && (uint32_t)id < header_->n_ids && pieces_[id * 2 + 1] != UINT32_MAX;
+		}
+
+		// 调用前需确认 contains(id)
+		std::string_view piece(uint32_t id) const
+		{
+			return std::string_view(arena_ + pieces_[id * 2], pieces_[id * 2 + 1]);
+		}
+
+		std::vector<int> special_ids() const
+		{
+			return std::vector<int>(special_, special_ + header_->n_special);
+		}
+
+		size_t size() const
+		{
+			return header_ ? header_->n_ids : 0;
+		}
+
+	private:
+		static uint32_t bucket_of(std::string_view key)
+		{
+			return (uint32_t)(uint8_t)key[0] << 8 | (uint8_t)key[1];
+		}
+
+		bool attach(const char *data, size_t size)
+		{
+			if (size < sizeof(binary_header))
+				return false;
+			header_ = (const binary_header *)data;
+			if (memcmp(header_->magic, BINARY_MAGIC, sizeof(BINARY_MAGIC)) != 0 || header_->version != BINARY_VERSION)
+				return false;
+
+			auto in_range = [size](uint64_t offset, uint64_t bytes)
+			{
+				return offset <= size && bytes <= size - offset;
+			};
+			if (!in_range(header_->pieces_offset, (uint64_t)header_->n_ids * 2 * sizeof(uint32_t)) ||
+				!in_range(header_->sorted_offset, (uint64_t)header_->n_sorted * sizeof(uint32_t)) ||
+				!in_range(header_->buckets_offset, (uint64_t)(BINARY_BUCKETS + 1) * sizeof(uint32_t)) ||
+				!in_range(header_->bytes_offset, 256 * sizeof(int32_t)) ||
+				!in_range(header_->special_offset, (uint64_t)header_->n_special * sizeof(uint32_t)) ||
+				!in_range(header_->arena_offset, header_->arena_size))
+				return false;
+
+			pieces_ = (const uint32_t *)(data + header_->pieces_offset);
+			sorted_ = (const uint32_t *)(data + header_->sorted_offset);
+			buckets_ = (const uint32_t *)(data + header_->buckets_offset);
+			bytes_ = (const int32_t *)(data + header_->bytes_offset);
+			special_ = (const uint32_t *)(data + header_->special_offset);
+			arena_ = data + header_->arena_offset;
+			if (!validate())
+			{
+				header_ = nullptr;
+				return false;
+			}
+			return true;
+		}
+
+		// 检查各段内容，文件截断或损坏时 piece()/find() 不会越界访问
+		bool validate() const
+		{
+			uint32_t n_ids = header_->n_ids;
+			for (uint32_t id = 0; id < n_ids; id++)
+			{
+				uint32_t size = pieces_[id * 2 + 1];
+				if (size != UINT32_MAX && (uint64_t)pieces_[id * 2] + size > header_->arena_size)
+					return false;
+			}
+			if (buckets_[0] != 0 || buckets_[BINARY_BUCKETS] != header_->n_sorted)
+				return false;
+			for (uint32_t b = 0; b < BINARY_BUCKETS; b++)
+			{
+				if (buckets_[b] > buckets_[b + 1])
+					return false;
+			}
+			for (uint32_t i = 0; i < header_->n_sorted; i++)
+			{
+				if (!contains(sorted_[i]) || piece(sorted_[i]).size() < 2)
+					return false;
+			}
+			// byte-level BPE 的合并从单字节开始，缺少任何一个字节时编码结果里会出现 -1
+			for (int b = 0; b < 256; b++)
+			{
+				if (!contains(bytes_[b]))
+					return false;
+			}
+			for (uint32_t i = 0; i < header_->n_special; i++)
+			{
+				if (!contains(special_[i]))
+					return false;
+			}
+			return true;
+		}
+
+		MMap mmap_;
+		std::vector<char> buffer_;
+
+		const binary_header *header_ = nullptr;
+		const uint32_t *pieces_ = nullptr;
+		const uint32_t *sorted_ = nullptr;
+		const uint32_t *buckets_ = nullptr;
+		const int32_t *bytes_ = nullptr;
+		const uint32_t *special_ = nullptr;
+		const char *arena_ = nullptr;
+	};
+
+} // namespace tiktoken
@@ -46,12 +46,6 @@ protected:
     std::vector<std::vector<ax_runner_tensor_t>> mgroup_output_tensors;
     std::vector<std::vector<ax_runner_tensor_t>> mgroup_input_tensors;
 
-    std::map<std::string, ax_runner_tensor_t> map_output_tensors;
-    std::map<std::string, ax_runner_tensor_t> map_input_tensors;
-
-    std::map<std::string, std::vector<ax_runner_tensor_t>> map_group_output_tensors;
-    std::map<std::string, std::vector<ax_runner_tensor_t>> map_group_input_tensors;
-
 public:
     virtual int init(const char *model_file, bool use_mmap = false) = 0;
     virtual int init(char *model_buffer, size_t model_size) = 0;
@@ -60,86 +54,77 @@ public:
 
     int get_num_inputs() { return minput_tensors.size(); };
     int get_num_outputs() { return moutput_tensors.size(); };
+    int get_num_groups() { return mgroup_input_tensors.size(); };
 
     const ax_runner_tensor_t &get_input(int idx) { return minput_tensors[idx]; }
     const ax_runner_tensor_t *get_inputs_ptr() { return minput_tensors.data(); }
-    const ax_runner_tensor_t &get_input(std::string name)
+    const ax_runner_tensor_t &get_input(const std::string &name) { return get_input(0, name); }
+
+    const ax_runner_tensor_t &get_input(int grpid, int idx) { return mgroup_input_tensors[grpid][idx]; }
+    const ax_runner_tensor_t *get_inputs_ptr(int grpid) { return mgroup_input_tensors[grpid].data(); }
+    const ax_runner_tensor_t &get_input(int grpid, const std::string &name)
     {
-        if (map_input_tensors.size() == 0)
-        {
-            for (size_t i = 0; i < minput_tensors.size(); i++)
-            {
-                map_input_tensors[minput_tensors[i].sName] = minput_tensors[i];
-            }
-        }
-        if (map_input_tensors.find(name) == map_input_tensors.end())
+        auto tensor = find_input(grpid, name);
+        if (!tensor)
         {
             throw std::runtime_error("input tensor not found: " + name);
         }
-
-        return map_input_tensors[name];
+        return *tensor;
     }
 
-    const ax_runner_tensor_t &get_input(int grpid, int idx) { return mgroup_input_tensors[grpid][idx]; }
-    const ax_runner_tensor_t *get_inputs_ptr(int grpid) { return mgroup_input_tensors[grpid].data(); }
-    const ax_runner_tensor_t &get_input(int grpid, std::string name)
+    int get_input_index(int grpid, const std::string &name)
     {
-        if (map_group_input_tensors.size() == 0)
+        for (size_t i = 0; i < mgroup_input_tensors[grpid].size(); i++)
         {
-            for (size_t i = 0; i < mgroup_input_tensors.size(); i++)
+            if (mgroup_input_tensors[grpid][i].sName == name)
             {
-                for (size_t j = 0; j < mgroup_input_tensors[i].size(); j++)
-                {
-                    map_group_input_tensors[mgroup_input_tensors[i][j].sName].push_back(mgroup_input_tensors[i][j]);
-                }
+                return i;
             }
         }
-        if (map_group_input_tensors.find(name) == map_group_input_tensors.end())
-        {
-            throw std::runtime_error("input tensor not found: " + name);
-        }
-        return map_group_input_tensors[name][grpid];
-        // return map_input_tensors[name];
+        return -1;
+    }
+
+    // 按名字解析 tensor，找不到时返回 nullptr
+    // 返回的指针在 init 之后保持不变，bind_input/bind_output 会同步更新其中的地址，
+    // 推理循环中应提前解析并保存，不要每次按名字查找
+    const ax_runner_tensor_t *find_input(int grpid, const std::string &name)
+    {
+        int idx = get_input_index(grpid, name);
+        return idx < 0 ? nullptr : &mgroup_input_tensors[grpid][idx];
     }
 
     const ax_runner_tensor_t &get_output(int idx) { return moutput_tensors[idx]; }
     const ax_runner_tensor_t *get_outputs_ptr() { return moutput_tensors.data(); }
-    const ax_runner_tensor_t &get_output(std::string name)
+    const ax_runner_tensor_t &get_output(const std::string &name) { return get_output(0, name); }
+
+    const ax_runner_tensor_t &get_output(int grpid, int idx) { return mgroup_output_tensors[grpid][idx]; }
+    const ax_runner_tensor_t *get_outputs_ptr(int grpid) { return mgroup_output_tensors[grpid].data(); }
+    const ax_runner_tensor_t &get_output(int grpid, const std::string &name)
     {
-        if (map_output_tensors.size() == 0)
-        {
-            for (size_t i = 0; i < moutput_tensors.size(); i++)
-            {
-                map_output_tensors[moutput_tensors[i].sName] = moutput_tensors[i];
-            }
-        }
-        if (map_output_tensors.find(name) == map_output_tensors.end())
+        auto tensor = find_output(grpid, name);
+        if (!tensor)
         {
             throw std::runtime_error("output tensor not found: " + name);
         }
-
-        return map_output_tensors[name];
+        return *tensor;
     }
 
-    const ax_runner_tensor_t &get_output(int grpid, int idx) { return mgroup_output_tensors[grpid][idx]; }
-    const ax_runner_tensor_t *get_outputs_ptr(int grpid) { return mgroup_output_tensors[grpid].data(); }
-    const ax_runner_tensor_t &get_output(int grpid, std::string name)
+    int get_output_index(int grpid, const std::string &name)
     {
-        if (map_group_output_tensors.size() == 0)
+        for (size_t i = 0; i < mgroup_output_tensors[grpid].size(); i++)
         {
-            for (size_t i = 0; i < mgroup_output_tensors.size(); i++)
+            if (mgroup_output_tensors[grpid][i].sName == name)
             {
-                for (size_t j = 0; j < mgroup_output_tensors[i].size(); j++)
-                {
-                    map_group_output_tensors[mgroup_output_tensors[i][j].sName].push_back(mgroup_output_tensors[i][j]);
-                }
+                return i;
             }
         }
-        if (map_group_output_tensors.find(name) == map_group_output_tensors.end())
-        {
-            throw std::runtime_error("input tensor not found: " + name);
-        }
-        return map_group_output_tensors[name][grpid];
+        return -1;
+    }
+
+    const ax_runner_tensor_t *find_output(int grpid, const std::string &name)
+    {
+        int idx = get_output_index(grpid, name);
+        return idx < 0 ? nullptr : &mgroup_output_tensors[grpid][idx];
     }
 
     virtual int inference() = 0;
@@ -2,16 +2,16 @@
 #include "string.h"
 #include "fstream"
 #include "memory"
+#include <mutex>
 // #include "utilities/file.hpp"
 #include <ax_sys_api.h>
 #include <ax_ivps_api.h>
 #include <ax_engine_api.h>
 #include <fcntl.h>
 #include "memory_utils.hpp"
+#include "thread_pool.hpp"
 #include "sample_log.h"
 
-#define AX_CMM_ALIGN_SIZE 128
-
 const char *AX_CMM_SESSION_NAME = "npu";
 
 typedef enum
@@ -128,12 +128,14 @@ void free_io(AX_ENGINE_IO_T *io)
     for (size_t j = 0; j < io->nInputSize; ++j)
     {
         AX_ENGINE_IO_BUFFER_T *pBuf = io->pInputs + j;
-        AX_SYS_MemFree(pBuf->phyAddr, pBuf->pVirAddr);
+        if (pBuf->pVirAddr)
+            AX_SYS_MemFree(pBuf->phyAddr, pBuf->pVirAddr);
     }
     for (size_t j = 0; j < io->nOutputSize; ++j)
     {
         AX_ENGINE_IO_BUFFER_T *pBuf = io->pOutputs + j;
-        AX_SYS_MemFree(pBuf->phyAddr, pBuf->pVirAddr);
+        if (pBuf->pVirAddr)
+            AX_SYS_MemFree(pBuf->phyAddr, pBuf->pVirAddr);
     }
     delete[] io->pInputs;
     delete[] io->pOutputs;
@@ -205,6 +207,10 @@ struct ax_joint_runner_ax650_handle_t
     std::vector<AX_ENGINE_IO_INFO_T *> io_info;
     std::vector<AX_ENGINE_IO_T> io_data;
 
+    // 被 bind_input/bind_output 替换掉的原缓冲区，key 为 (grpid, idx)，释放时以这里为准
+    std::map<std::pair<int, int>, AX_ENGINE_IO_BUFFER_T> origin_inputs;
+    std::map<std::pair<int, int>, AX_ENGINE_IO_BUFFER_T> origin_outputs;
+
     // int algo_width, algo_height;
     // int algo_colorformat;
 };
@@ -350,7 +356,10 @@ int ax_runner_ax650::init(char *model_buffer, size_t model_size)
         m_handle = new ax_joint_runner_ax650_handle_t;
     }
 
+    // 多个线程可能同时创建 handle，引擎只初始化一次
+    static std::mutex init_mutex;
     static bool b_init = false;
+    std::unique_lock<std::mutex> init_lock(init_mutex);
     if (!b_init)
     {
         // 1. init engine
@@ -365,6 +374,7 @@ int ax_runner_ax650::init(char *model_buffer, size_t model_size)
         }
         b_init = true;
     }
+    init_lock.unlock();
 
     // 3. create handle
 
@@ -381,6 +391,22 @@ int ax_runner_ax650::init(char *model_buffer, size_t model_size)
 
 void ax_runner_ax650::release()
 {
+    inference_wait();
+    if (m_handle)
+    {
+        // 还原被绑定的缓冲区，外部缓冲区不归这里释放
+        for (auto &it : m_handle->origin_inputs)
+        {
+            m_handle->io_data[it.first.first].pInputs[it.first.second] = it.second;
+        }
+        for (auto &it : m_handle->origin_outputs)
+        {
+            m_handle->io_data[it.first.first].pOutputs[it.first.second] = it.second;
+        }
+        m_handle->origin_inputs.clear();
+        m_handle->origin_outputs.clear();
+    }
+
     if (m_handle && m_handle->handle)
     {
         for (size_t i = 0; i < m_handle->io_data.size(); i++)
@@ -401,19 +427,16 @@ void ax_runner_ax650::release()
 
     moutput_tensors.clear();
     minput_tensors.clear();
-    map_input_tensors.clear();
-    map_output_tensors.clear();
 
     mgroup_output_tensors.clear();
     mgroup_input_tensors.clear();
-    map_group_input_tensors.clear();
-    map_group_output_tensors.clear();
 
     // AX_ENGINE_Deinit();
 }
 
 void ax_runner_ax650::deinit()
 {
+    inference_wait();
     if (m_handle && m_handle->handle)
     {
         // free_io(&m_handle->io_data);
@@ -439,3 +462,139 @@ int ax_runner_ax650::inference(int grpid)
 {
     return AX_ENGINE_RunGroupIOSync(m_handle->handle, m_handle->context, grpid, &m_handle->io_data[grpid]);
 }
+
+// 所有 runner 共用一个提交线程：NPU 按提交顺序依次执行，一个线程就能保证顺序，也不会为每层创建线程
+static ThreadPool &npu_submit_thread()
+{
+    static ThreadPool pool(1);
+    return pool;
+}
+
+int ax_runner_ax650::inference_async(int grpid)
+{
+    if (_async_result.valid())
+    {
+        ALOGE("previous async inference not finished");
+        return -1;
+    }
+    _async_result = npu_submit_thread().enqueue([this, grpid]
+                                                { return inference(grpid); });
+    return 0;
+}
+
+int ax_runner_ax650::inference_wait()
+{
+    if (!_async_result.valid())
+    {
+        return 0;
+    }
+    return _async_result.get();
+}
+
+
+static int bind_io_buffer(AX_ENGINE_IO_BUFFER_T *pBuf, std::map<std::pair<int, int>, AX_ENGINE_IO_BUFFER_T> &origins, std::pair<int, int> key,
+                          unsigned long phyAddr, void *pVirAddr, bool b_free_origin)
+{
+    auto it = origins.find(key);
+    if (it == origins.end())
+    {
+        it = origins.emplace(key, *pBuf).first;
+    }
+    if (b_free_origin && it->second.pVirAddr)
+    {
+        AX_SYS_MemFree(it->second.phyAddr, it->second.pVirAddr);
+        it->second.phyAddr = 0;
+        it->second.pVirAddr = nullptr;
+    }
+    pBuf->phyAddr = phyAddr;
+    pBuf->pVirAddr = pVirAddr;
+    return 0;
+}
+
+static void update_tensor(ax_runner_tensor_t &tensor, unsigned long phyAddr, void *pVirAddr)
+{
+    tensor.phyAddr = phyAddr;
+    tensor.pVirAddr = pVirAddr;
+}
+
+int ax_runner_ax650::bind_input(int grpid, const std::string &name, unsigned long phyAddr, void *pVirAddr, bool b_free_origin)
+{
+    if (!m_handle || grpid >= (int)mgroup_input_tensors.size())
+    {
+        ALOGE("invalid grpid %d", grpid);
+        return -1;
+    }
+    int idx = get_input_index(grpid, name);
+    if (idx < 0)
+    {
+        ALOGE("input tensor not found: %s", name.c_str());
+        return -1;
+    }
+    return bind_input(grpid, idx, phyAddr, pVirAddr, b_free_origin);
+}
+
+int ax_runner_ax650::bind_output(int grpid, const std::string &name, unsigned long phyAddr, void *pVirAddr, bool b_free_origin)
+{
+    if (!m_handle || grpid >= (int)mgroup_output_tensors.size())
+    {
+        ALOGE("invalid grpid %d", grpid);
+        return -1;
+    }
+    int idx = get_output_index(grpid, name);
+    if (idx < 0)
+    {
+        ALOGE("output tensor not found: %s", name.c_str());
+        return -1;
+    }
+    return bind_output(grpid, idx, phyAddr, pVirAddr, b_free_origin);
+}
+
+int ax_runner_ax650::bind_input(int grpid, int idx, unsigned long phyAddr, void *pVirAddr, bool b_free_origin)
+{
+    bind_io_buffer(m_handle->io_data[grpid].pInputs + idx, m_handle->origin_inputs, {grpid, idx}, phyAddr, pVirAddr, b_free_origin);
+    update_tensor(mgroup_input_tensors[grpid][idx], phyAddr, pVirAddr);
+    if (grpid == 0)
+    {
+        update_tensor(minput_tensors[idx], phyAddr, pVirAddr);
+    }
+    return 0;
+}
+
+int ax_runner_ax650::bind_output(int grpid, int idx, unsigned long phyAddr, void *pVirAddr, bool b_free_origin)
+{
+    bind_io_buffer(m_handle->io_data[grpid].pOutputs + idx, m_handle->origin_outputs, {grpid, idx}, phyAddr, pVirAddr, b_free_origin);
+    update_tensor(mgroup_output_tensors[grpid][idx], phyAddr, pVirAddr);
+    if (grpid == 0)
+    {
+        update_tensor(moutput_tensors[idx], phyAddr, pVirAddr);
+    }
+    return 0;
+}
+
+int ax_runner_ax650::unbind_input(int grpid, int idx)
+{
+    auto it = m_handle->origin_inputs.find({grpid, idx});
+    if (it == m_handle->origin_inputs.end())
+    {
+        return 0;
+    }
+    if (!it->second.pVirAddr)
+    {
+        return -1;
+    }
+    return bind_input(grpid, idx, it->second.phyAddr, it->second.pVirAddr, false);
+}
+
+int ax_runner_ax650::unbind_output(int grpid, int idx)
+{
+    auto it = m_handle->origin_outputs.find({grpid, idx});
+    if (it == m_handle->origin_outputs.end())
+    {
+        return 0;
+    }
+    if (!it->second.pVirAddr)
+    {
+        return -1;
+    }
+    return bind_output(grpid, idx, it->second.phyAddr, it->second.pVirAddr, false);
+}
\ No newline at end of file
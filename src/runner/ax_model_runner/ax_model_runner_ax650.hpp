@@ -1,6 +1,9 @@
 #pragma once
+#include <future>
 #include "ax_model_runner.hpp"
 
+#define AX_CMM_ALIGN_SIZE 128
+
 class ax_runner_ax650 : public ax_runner_base
 {
 protected:
@@ -8,6 +11,8 @@ protected:
 
     bool _parepare_io = false;
 
+    std::future<int> _async_result;
+
     int sub_init();
 
 public:
@@ -19,4 +24,19 @@ public:
 
     int inference() override;
     int inference(int grpid) override;
+    // 异步推理：把 grpid 组交给 NPU 提交线程后立即返回，调用方可以在 NPU 推理期间准备后面的输入，
+    // 再用 inference_wait 等待完成并取得返回值；同一个 runner 同时只能有一个未完成的异步推理
+    int inference_async(int grpid);
+    int inference_wait();
+
+    // 把 grpid 组的输入/输出绑定到外部的 CMM 缓冲区（例如上一个模型的输出），数据在模型之间直接传递，不再经过 host 内存
+    // b_free_origin 为 true 时释放 prepare_io 分配的原缓冲区以节省 CMM，外部缓冲区的生命周期由调用方保证
+    int bind_input(int grpid, const std::string &name, unsigned long phyAddr, void *pVirAddr, bool b_free_origin = false);
+    int bind_output(int grpid, const std::string &name, unsigned long phyAddr, void *pVirAddr, bool b_free_origin = false);
+    // 按下标绑定，只改写对应的 tensor，已经拿到的 get_input/get_output 引用依然有效，可以在每次推理前调用
+    int bind_input(int grpid, int idx, unsigned long phyAddr, void *pVirAddr, bool b_free_origin = false);
+    int bind_output(int grpid, int idx, unsigned long phyAddr, void *pVirAddr, bool b_free_origin = false);
+    // 恢复 prepare_io 分配的原缓冲区，原缓冲区已被释放时返回 -1
+    int unbind_input(int grpid, int idx);
+    int unbind_output(int grpid, int idx);
 };
\ No newline at end of file
@@ -1,5 +1,16 @@
 #pragma once
 #include <vector>
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define BF16_KERNEL_NEON 1
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define BF16_KERNEL_AVX2 1
+#endif
 
 struct bfloat16
 {
@@ -42,30 +53,170 @@ public:
     }
 };
 
-static std::vector<std::pair<int, float>> topk_bfloat16(unsigned short *arr, int size, int k)
+// bf16 转 fp32 只是左移 16 位，NEON/AVX2 每次处理 8 个，剩余部分走标量
+static inline void bfloat16_to_float(const unsigned short *src, float *dst, int n)
 {
-    std::vector<std::pair<int, float>> result;
+    int i = 0;
+#if defined(BF16_KERNEL_NEON)
+    for (; i + 8 <= n; i += 8)
+    {
+        uint16x8_t v = vld1q_u16(src + i);
+        vst1q_f32(dst + i, vreinterpretq_f32_u32(vshll_n_u16(vget_low_u16(v), 16)));
+        vst1q_f32(dst + i + 4, vreinterpretq_f32_u32(vshll_n_u16(vget_high_u16(v), 16)));
+    }
+#elif defined(BF16_KERNEL_AVX2)
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm256_storeu_ps(dst + i, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(v), 16)));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        unsigned int proc = (unsigned int)src[i] << 16;
+        memcpy(dst + i, &proc, sizeof(float));
+    }
+}
+
+// 一次遍历求最大值的下标，dst 不为空时顺带写出转换后的 fp32；最大值相同时取下标最小的，与 std::max_element 一致
+static inline int argmax_bfloat16(const unsigned short *src, int n, float *max_val = nullptr, float *dst = nullptr)
+{
+    int i = 0;
+    float best_val = -INFINITY;
+    int best_idx = 0;
+#if defined(BF16_KERNEL_NEON) || defined(BF16_KERNEL_AVX2)
+    if (n >= 8)
+    {
+        float lane_val[8];
+        unsigned int lane_idx[8];
+#if defined(BF16_KERNEL_NEON)
+        const unsigned int init_idx[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+        float32x4_t vmax0 = vdupq_n_f32(-INFINITY), vmax1 = vdupq_n_f32(-INFINITY);
+        uint32x4_t vidx0 = vld1q_u32(init_idx), vidx1 = vld1q_u32(init_idx + 4);
+        uint32x4_t vbest0 = vidx0, vbest1 = vidx1;
+        const uint32x4_t vstep = vdupq_n_u32(8);
+        for (; i + 8 <= n; i += 8)
+        {
+            uint16x8_t v = vld1q_u16(src + i);
+            float32x4_t lo = vreinterpretq_f32_u32(vshll_n_u16(vget_low_u16(v), 16));
+            float32x4_t hi = vreinterpretq_f32_u32(vshll_n_u16(vget_high_u16(v), 16));
+            if (dst)
+            {
+                vst1q_f32(dst + i, lo);
+                vst1q_f32(dst + i + 4, hi);
+            }
+            uint32x4_t m0 = vcgtq_f32(lo, vmax0);
+            uint32x4_t m1 = vcgtq_f32(hi, vmax1);
+            vmax0 = vbslq_f32(m0, lo, vmax0);
+            vmax1 = vbslq_f32(m1, hi, vmax1);
+            vbest0 = vbslq_u32(m0, vidx0, vbest0);
+            vbest1 = vbslq_u32(m1, vidx1, vbest1);
+            vidx0 = vaddq_u32(vidx0, vstep);
+            vidx1 = vaddq_u32(vidx1, vstep);
+        }
+        vst1q_f32(lane_val, vmax0);
+        vst1q_f32(lane_val + 4, vmax1);
+        vst1q_u32(lane_idx, vbest0);
+        vst1q_u32(lane_idx + 4, vbest1);
+#else
+        __m256 vmax = _mm256_set1_ps(-INFINITY);
+        __m256i vidx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        __m256i vbest = vidx;
+        const __m256i vstep = _mm256_set1_epi32(8);
+        for (; i + 8 <= n; i += 8)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+            __m256 f = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(v), 16));
+            if (dst)
+            {
+                _mm256_storeu_ps(dst + i, f);
+            }
+            __m256 m = _mm256_cmp_ps(f, vmax, _CMP_GT_OQ);
+            vmax = _mm256_blendv_ps(vmax, f, m);
+            vbest = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(vbest), _mm256_castsi256_ps(vidx), m));
+            vidx = _mm256_add_epi32(vidx, vstep);
+        }
+        _mm256_storeu_ps(lane_val, vmax);
+        _mm256_storeu_si256((__m256i *)lane_idx, vbest);
+#endif
+        best_val = lane_val[0];
+        best_idx = lane_idx[0];
+        for (int l = 1; l < 8; l++)
+        {
+            if (lane_val[l] > best_val || (lane_val[l] == best_val && (int)lane_idx[l] < best_idx))
+            {
+                best_val = lane_val[l];
+                best_idx = lane_idx[l];
+            }
+        }
+    }
+#endif
+    for (; i < n; i++)
+    {
+        unsigned int proc = (unsigned int)src[i] << 16;
+        float val;
+        memcpy(&val, &proc, sizeof(float));
+        if (dst)
+        {
+            dst[i] = val;
+        }
+        if (val > best_val)
+        {
+            best_val = val;
+            best_idx = i;
+        }
+    }
+    if (max_val)
+    {
+        *max_val = best_val;
+    }
+    return best_idx;
+}
 
-    // Create a vector of pairs with index and value
-    std::vector<std::pair<int, float>> indexedValues;
-    indexedValues.reserve(size);
-    for (int i = 0; i < size; ++i)
+// 一次遍历取最大的 k 个值，按值从大到小写入 result（复用调用方的缓冲区）。
+// 按块转成 fp32 后只有大于当前第 k 大的值才进入大小为 k 的小顶堆，不再对整个词表排序
+static inline void topk_bfloat16(const unsigned short *arr, int size, int k, std::vector<std::pair<int, float>> &result)
+{
+    result.clear();
+    k = std::min(k, size);
+    if (k <= 0)
     {
-        indexedValues.push_back(std::make_pair(i, bfloat16(arr[i])));
+        return;
     }
 
-    // Sort the vector based on the values in descending order
-    std::sort(indexedValues.begin(), indexedValues.end(),
-              [](const std::pair<int, float> &a, const std::pair<int, float> &b)
-              {
-                  return a.second > b.second;
-              });
+    auto cmp = [](const std::pair<int, float> &a, const std::pair<int, float> &b)
+    {
+        return a.second > b.second || (a.second == b.second && a.first < b.first);
+    };
 
-    // Take the top k elements
-    for (int i = 0; i < k; ++i)
+    const int block = 256;
+    float vals[block];
+    for (int base = 0; base < size; base += block)
     {
-        result.push_back(indexedValues[i]);
+        int len = std::min(block, size - base);
+        bfloat16_to_float(arr + base, vals, len);
+        for (int j = 0; j < len; j++)
+        {
+            if ((int)result.size() < k)
+            {
+                result.emplace_back(base + j, vals[j]);
+                std::push_heap(result.begin(), result.end(), cmp);
+            }
+            else if (vals[j] > result.front().second)
+            {
+                std::pop_heap(result.begin(), result.end(), cmp);
+                result.back() = std::make_pair(base + j, vals[j]);
+                std::push_heap(result.begin(), result.end(), cmp);
+            }
+        }
     }
+    std::sort_heap(result.begin(), result.end(), cmp);
+}
 
+static std::vector<std::pair<int, float>> topk_bfloat16(unsigned short *arr, int size, int k)
+{
+    std::vector<std::pair<int, float>> result;
+    result.reserve(std::max(k, 0));
+    topk_bfloat16(arr, size, k, result);
     return result;
-}
\ No newline at end of file
+}
@@ -1,4 +1,8 @@
 #include "memory_utils.hpp"
+#include <functional>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 bool file_exist(const std::string &path)
 {
@@ -11,55 +15,64 @@ bool file_exist(const std::string &path)
     return flag;
 }
 
-bool read_file(const std::string &path, std::vector<char> &data)
+// 用 pread 按偏移读取，不共享文件读写位置，多个线程同时读不同文件时互不影响
+static bool pread_file(const std::string &path, size_t *len, std::function<char *(size_t)> alloc)
 {
-
-    std::fstream fs(path, std::ios::in | std::ios::binary);
-
-    if (!fs.is_open())
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
     {
         return false;
     }
 
-    // get file size
-    fs.seekg(0, std::ios::end);
-    size_t file_size = fs.tellg();
-    fs.seekg(0, std::ios::beg);
-
-    if (file_size == 0)
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
     {
+        close(fd);
         return false;
     }
+    *len = st.st_size;
 
-    data.resize(file_size);
-    fs.read(data.data(), file_size);
-    // data.insert(data.end(), std::istreambuf_iterator<char>(fs), std::istreambuf_iterator<char>());
-
-    fs.close();
+    char *data = alloc(*len);
+    size_t offset = 0;
+    while (offset < *len)
+    {
+        ssize_t n = pread(fd, data + offset, *len - offset, offset);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            close(fd);
+            return false;
+        }
+        offset += n;
+    }
 
+    close(fd);
     return true;
 }
 
-bool read_file(const std::string &path, char **data, size_t *len)
+bool read_file(const std::string &path, std::vector<char> &data)
 {
-    FILE *fp = fopen(path.c_str(), "rb");
+    size_t len;
+    return pread_file(path, &len, [&data](size_t size)
+                      {
+        data.resize(size);
+        return data.data(); });
+}
 
-    if (!fp)
+bool read_file(const std::string &path, char **data, size_t *len)
+{
+    *data = nullptr;
+    if (!pread_file(path, len, [data](size_t size)
+                    {
+        *data = new char[size];
+        return *data; }))
     {
+        delete[] *data;
+        *data = nullptr;
         return false;
     }
-
-    fseek(fp, 0, SEEK_END);
-
-    *len = ftell(fp);
-
-    fseek(fp, 0, SEEK_SET);
-
-    *data = new char[*len];
-
-    fread(*data, *len, 1, fp);
-
-    fclose(fp);
-
     return true;
 }
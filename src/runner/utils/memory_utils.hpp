@@ -1,6 +1,7 @@
 #pragma once
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <fstream>
 #include <vector>
@@ -17,18 +18,20 @@ private:
 
 public:
     MMap() {}
-    MMap(const char *file)
+    MMap(const char *file, bool b_readonly = false)
     {
-        open_file(file);
+        open_file(file, b_readonly);
     }
     ~MMap()
     {
         close_file();
     }
 
-    bool open_file(const char *file)
+    // b_readonly 时以只读方式映射，多个进程映射同一个文件时共享物理内存
+    bool open_file(const char *file, bool b_readonly = false)
     {
-        _add = _mmap(file, &_size);
+        close_file();
+        _add = _mmap(file, &_size, b_readonly);
         if (!_add)
         {
             return false;
@@ -56,7 +59,7 @@ public:
         return _add;
     }
 
-    static void *_mmap(const char *model_file, int *model_size)
+    static void *_mmap(const char *model_file, int *model_size, bool b_readonly = false)
     {
         auto *file_fp = fopen(model_file, "r");
         if (!file_fp)
@@ -67,8 +70,13 @@ public:
         fseek(file_fp, 0, SEEK_END);
         *model_size = ftell(file_fp);
         fclose(file_fp);
-        int fd = open(model_file, O_RDWR, 0644);
-        void *mmap_add = mmap(NULL, *model_size, PROT_WRITE, MAP_SHARED, fd, 0);
-        return mmap_add;
+        int fd = open(model_file, b_readonly ? O_RDONLY : O_RDWR, 0644);
+        if (fd < 0)
+        {
+            return nullptr;
+        }
+        void *mmap_add = mmap(NULL, *model_size, b_readonly ? PROT_READ : PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        return mmap_add == MAP_FAILED ? nullptr : mmap_add;
     }
 };
\ No newline at end of file
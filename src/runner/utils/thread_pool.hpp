@@ -0,0 +1,78 @@
+#pragma once
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+
+// 简单的固定线程数线程池，enqueue 返回 std::future 获取结果，析构时执行完剩余任务再退出
+class ThreadPool
+{
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool b_stop = false;
+
+public:
+    explicit ThreadPool(int num_threads)
+    {
+        if (num_threads < 1)
+        {
+            num_threads = 1;
+        }
+        for (int i = 0; i < num_threads; i++)
+        {
+            workers.emplace_back([this]
+                                 {
+                while (true)
+                {
+                    std::function<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock(mtx);
+                        cv.wait(lock, [this]
+                                { return b_stop || !tasks.empty(); });
+                        if (tasks.empty())
+                        {
+                            return;
+                        }
+                        task = std::move(tasks.front());
+                        tasks.pop();
+                    }
+                    task();
+                } });
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            b_stop = true;
+        }
+        cv.notify_all();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    template <class F>
+    auto enqueue(F &&f) -> std::future<decltype(f())>
+    {
+        typedef decltype(f()) return_type;
+        auto task = std::make_shared<std::packaged_task<return_type()>>(std::forward<F>(f));
+        std::future<return_type> res = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            tasks.emplace([task]
+                          { (*task)(); });
+        }
+        cv.notify_one();
+        return res;
+    }
+};
@@ -0,0 +1,181 @@
+// 校验 qwen_pretokenizer 与 RE2 按 QWEN_PAT_STR 切分的结果逐字节一致，并比较两者的速度
+// 用法: qwen_pretokenize_check [--vocab qwen.tiktoken.bin] [corpus_file ...]
+// 语料为随机生成的文本加上命令行给出的文件；给出 tiktoken_compile 生成的词表时，同时比较完整 encode 的结果和耗时
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <sstream>
+
+#include "../src/runner/Tokenizer/tiktoken.h"
+
+static double now_ms()
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::string to_hex(std::string_view s)
+{
+    std::string out;
+    char buf[4];
+    for (unsigned char c : s)
+    {
+        snprintf(buf, sizeof(buf), "%02x", c);
+        out += buf;
+    }
+    return out;
+}
+
+static std::vector<std::string_view> split_re2(const re2::RE2 &regex, std::string_view text)
+{
+    std::vector<std::string_view> pieces;
+    re2::StringPiece input(text.data(), text.size());
+    re2::StringPiece piece;
+    while (re2::RE2::FindAndConsume(&input, regex, &piece))
+    {
+        pieces.emplace_back(piece.data(), piece.size());
+    }
+    return pieces;
+}
+
+static std::vector<std::string_view> split_native(std::string_view text)
+{
+    std::vector<std::string_view> pieces;
+    tiktoken::qwen_pretokenizer pretokenizer(text);
+    std::string_view piece;
+    while (pretokenizer.next(piece))
+    {
+        pieces.push_back(piece);
+    }
+    return pieces;
+}
+
+// 覆盖各个分支的边界：缩写、大小写、ſ、\v \f、Unicode 空白、组合字符、各种数字、换行组合和非法 UTF-8
+static std::vector<std::string> random_corpus(int count)
+{
+    const std::vector<std::string> fragments = {
+        "a", "Z", "hello", "World", "'s", "'S", "'re", "'VE", "'ll", "'d", "'m", "'t", "'x", "'", "\xc5\xbf",
+        "0", "123", "\xef\xbc\x91", "\xc2\xb2", "\xe2\x85\xab", "\xd9\xa1",
+        " ", "  ", "\t", "\n", "\r\n", "\v", "\f", "\xc2\xa0", "\xe3\x80\x80", "\xc2\x85",
+        "\xe4\xbd\xa0\xe5\xa5\xbd", "\xe3\x80\x82", "\xef\xbc\x8c", "\xc3\xa9", "e\xcc\x81", "\xf0\x9f\x98\x80",
+        ".", ",", "!!", "?", "-", "=", "_", "\"", "(", ")", "<|", "|>", "http://a.b/c?d=1",
+        "\xff", "\xc3", "\xc0\x80", "\xed\xa0\x80", "\xf4\x90\x80\x80", "\xe4\xbd",
+    };
+    std::mt19937 rng(20240601);
+    std::vector<std::string> corpus;
+    for (int i = 0; i < count; i++)
+    {
+        std::string text;
+        int n = rng() % 48;
+        for (int j = 0; j < n; j++)
+        {
+            text += fragments[rng() % fragments.size()];
+        }
+        corpus.push_back(text);
+    }
+    return corpus;
+}
+
+static double bench(const std::function<void()> &func, int repeat)
+{
+    double t = now_ms();
+    for (int i = 0; i < repeat; i++)
+    {
+        func();
+    }
+    return (now_ms() - t) / repeat;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string vocab_path;
+    auto corpus = random_corpus(20000);
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--vocab" && i + 1 < argc)
+        {
+            vocab_path = argv[++i];
+            continue;
+        }
+        std::ifstream fin(arg, std::ios::binary);
+        if (!fin)
+        {
+            printf("open %s failed\n", arg.c_str());
+            return 1;
+        }
+        std::stringstream ss;
+        ss << fin.rdbuf();
+        corpus.push_back(ss.str());
+    }
+
+    re2::RE2 regex("(" + tiktoken::QWEN_PAT_STR + ")");
+    size_t total_bytes = 0, total_pieces = 0;
+    for (auto &text : corpus)
+    {
+        auto expected = split_re2(regex, text);
+        auto pieces = split_native(text);
+        if (pieces != expected)
+        {
+            printf("mismatch on text %s\n", to_hex(text).c_str());
+            for (size_t i = 0; i < std::max(pieces.size(), expected.size()); i++)
+            {
+                printf("  %zu: re2 %s native %s\n", i,
+                       i < expected.size() ? to_hex(expected[i]).c_str() : "-",
+                       i < pieces.size() ? to_hex(pieces[i]).c_str() : "-");
+            }
+            return 1;
+        }
+        total_bytes += text.size();
+        total_pieces += pieces.size();
+    }
+    printf("verify ok: %zu texts, %zu bytes, %zu pieces\n", corpus.size(), total_bytes, total_pieces);
+
+    // 拼成一段长文本测速
+    std::string text;
+    for (auto &t : corpus)
+    {
+        text += t;
+    }
+    int repeat = std::max(1, (int)(16 * 1024 * 1024 / std::max<size_t>(text.size(), 1)));
+    double t_re2 = bench([&]
+                         { split_re2(regex, text); },
+                         repeat);
+    double t_native = bench([&]
+                            { split_native(text); },
+                            repeat);
+    printf("pretokenize %zu bytes: re2 %.2f ms (%.1f MB/s), native %.2f ms (%.1f MB/s)\n", text.size(),
+           t_re2, text.size() / t_re2 / 1e3, t_native, text.size() / t_native / 1e3);
+
+    if (!vocab_path.empty())
+    {
+        auto vocab = std::make_shared<tiktoken::binary_vocab>();
+        if (!vocab->load(vocab_path))
+        {
+            printf("load %s failed, it should be generated by tiktoken_compile\n", vocab_path.c_str());
+            return 1;
+        }
+        // 外面多套一层分组，模式不再等于 QWEN_PAT_STR，tiktoken 会使用 RE2
+        tiktoken::tiktoken tk_native(vocab, tiktoken::QWEN_PAT_STR);
+        tiktoken::tiktoken tk_re2(vocab, "(?:" + tiktoken::QWEN_PAT_STR + ")");
+        tk_native.set_cache_capacity(0);
+        tk_re2.set_cache_capacity(0);
+        for (auto &t : corpus)
+        {
+            if (tk_native.encode(t) != tk_re2.encode(t))
+            {
+                printf("encode mismatch on text %s\n", to_hex(t).c_str());
+                return 1;
+            }
+        }
+        double e_re2 = bench([&]
+                             { tk_re2.encode(text); },
+                             repeat);
+        double e_native = bench([&]
+                                { tk_native.encode(text); },
+                                repeat);
+        printf("encode %zu bytes: re2 %.2f ms, native %.2f ms\n", text.size(), e_re2, e_native);
+    }
+    return 0;
+}
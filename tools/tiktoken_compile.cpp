@@ -0,0 +1,106 @@
+// 把 qwen.tiktoken（每行 "base64(token) rank"）编译成 QwenTokenizer 可以直接 mmap 加载的二进制词表
+// 用法: tiktoken_compile qwen.tiktoken qwen.tiktoken.bin
+#include <chrono>
+#include <fstream>
+#include <iostream>
+
+#include "../src/runner/Tokenizer/QwenTokenizer.hpp"
+#include "../src/runner/Tokenizer/base64.h"
+
+static double now_ms()
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        std::cout << "Usage: " << argv[0] << " <tiktoken_input_file> <binary_output_file>" << std::endl;
+        return 1;
+    }
+
+    std::ifstream fin(argv[1]);
+    if (!fin)
+    {
+        std::cout << "open " << argv[1] << " failed" << std::endl;
+        return 1;
+    }
+    ankerl::unordered_dense::map<std::string, int> encoder;
+    std::string line;
+    while (std::getline(fin, line))
+    {
+        auto pos = line.find(' ');
+        if (pos == std::string::npos)
+        {
+            continue;
+        }
+        auto token = base64::decode({line.data(), pos});
+        if (!encoder.emplace(token, std::stoi(line.substr(pos + 1))).second)
+        {
+            std::cout << "duplicate item: " << line << std::endl;
+            return 1;
+        }
+    }
+
+    // byte-level BPE 从单字节开始合并，词表必须包含全部 256 个字节，否则加载时会被拒绝
+    for (int b = 0; b < 256; b++)
+    {
+        if (encoder.find(std::string(1, (char)b)) == encoder.end())
+        {
+            std::cout << "missing single byte token: " << b << std::endl;
+            return 1;
+        }
+    }
+
+    // 与 QwenTokenizer 加载文本词表时一致，special token 接在词表之后
+    ankerl::unordered_dense::map<std::string, int> special_encoder;
+    auto special_tokens = QwenTokenizer::special_tokens();
+    for (size_t i = 0; i < special_tokens.size(); i++)
+    {
+        special_encoder[special_tokens[i]] = encoder.size() + i;
+    }
+
+    auto data = tiktoken::binary_vocab::build(encoder, special_encoder);
+    std::ofstream fout(argv[2], std::ios::binary);
+    fout.write(data.data(), data.size());
+    fout.close();
+    if (!fout)
+    {
+        std::cout << "write " << argv[2] << " failed" << std::endl;
+        return 1;
+    }
+    std::cout << "tokens: " << encoder.size() << ", special tokens: " << special_encoder.size() << ", size: " << data.size() << " bytes" << std::endl;
+
+    // 校验：每个 token 都能查到，两种格式加载后编码结果一致
+    tiktoken::binary_vocab vocab;
+    if (!vocab.load(argv[2]))
+    {
+        std::cout << "load " << argv[2] << " failed" << std::endl;
+        return 1;
+    }
+    for (const auto &[token, id] : encoder)
+    {
+        if (vocab.find(token) != id || vocab.piece(id) != token)
+        {
+            std::cout << "verify token " << id << " failed" << std::endl;
+            return 1;
+        }
+    }
+
+    double t0 = now_ms();
+    QwenTokenizer text_tokenizer(argv[1], QwenConfig());
+    double t1 = now_ms();
+    QwenTokenizer binary_tokenizer(argv[2], QwenConfig());
+    double t2 = now_ms();
+    std::string sample = "<|im_start|>system\nYou are a helpful assistant.<|im_end|>\n<|im_start|>user\n"
+                         "Hello, 今天天气怎么样？ I'm fine 123456 !!\n\n  <|extra_3|><|im_end|>\n<|im_start|>assistant\n";
+    auto ids = text_tokenizer.tokenizer.encode(sample);
+    if (ids != binary_tokenizer.tokenizer.encode(sample) || binary_tokenizer.tokenizer.decode(ids) != sample)
+    {
+        std::cout << "verify encode failed" << std::endl;
+        return 1;
+    }
+    std::cout << "load text: " << t1 - t0 << " ms, load binary: " << t2 - t1 << " ms" << std::endl;
+    return 0;
+}